@@ -0,0 +1,259 @@
+#!/bin/sh
+# Fixed-seed checks of the emulator's features.  Run from the top of the
+# tree; builds into a scratch directory, prints one line per check and
+# exits non-zero if any failed.
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+emu="$dir/emulator"
+gcc -ansi -Wall -pedantic -o "$emu" emulator.c sr.c gbn.c consumer.c -pthread -lm || exit 1
+failed=0
+
+# run OUT MSGS LOSS CORRUPT INTERVAL [option...]: a TRACE 0 run into OUT;
+# the direction is asked for only if there is loss or corruption
+run() {
+  out=$1 msgs=$2 loss=$3 corrupt=$4 interval=$5
+  shift 5
+  if awk "BEGIN { exit !($loss == 0 && $corrupt == 0) }"; then
+    printf '%s\n%s\n%s\n%s\n0\n' "$msgs" "$loss" "$corrupt" "$interval"
+  else
+    printf '%s\n%s\n%s\n2\n%s\n0\n' "$msgs" "$loss" "$corrupt" "$interval"
+  fi | "$emu" "$@" > "$dir/$out" 2>&1
+}
+
+# value OUT TEXT: the first number after TEXT on the line starting with it
+value() {
+  sed -n "s/^$2[^0-9]*\([0-9][0-9.]*\).*/\1/p" "$dir/$1" | head -n 1
+}
+
+# check NAME COMMAND...: report whether COMMAND succeeds
+check() {
+  name=$1
+  shift
+  if "$@"; then
+    echo "ok    $name"
+  else
+    echo "FAIL  $name"
+    failed=1
+  fi
+}
+
+# at_least N M: N >= M, for decimals too
+at_least() {
+  [ -n "$1" ] && awk "BEGIN { exit !($1 >= $2) }"
+}
+
+# the statistics from "number of messages dropped" on, for comparing runs
+counters() {
+  sed -n '/^number of messages dropped/,$p' "$dir/$1"
+}
+
+
+# user-026: the window never passes WINDOWSIZE and B, with no consumer, always offers all of it
+run cc 3000 0.2 0.2 5 --cc --cwnd-log "$dir/cwnd.log"
+check "congestion window stays within the advertised window" \
+  awk '!/^#/ { n++; if ($2 > 6 || $4 > 6 || $5 != 6) bad = 1 }
+       END { exit bad || n == 0 }' "$dir/cwnd.log"
+check "congestion control delivers" at_least "$(value cc 'number of messages delivered')" 1
+
+# user-027: parity rebuilds lost packets, and what it rebuilds is what A sent
+run fec 3000 0.1 0.1 5 --fec 3
+check "FEC recovers lost packets" at_least "$(value fec 'number of packets recovered from FEC')" 1
+check "FEC recovers them intact" [ "$(value fec 'number of them unlike')" = 0 ]
+
+# user-028: packets carry several messages, and corrupted ACKs, which carry
+# none, are still all caught
+run aggregate 3000 0.1 0.1 1 --aggregate 3
+check "aggregation packs several messages a packet" \
+  at_least "$(value aggregate 'average number of messages per data packet')" 2
+check "aggregated messages arrive intact" [ "$(value aggregate 'number of them unlike')" = 0 ]
+printf '3000\n0\n0.3\n1\n5\n1\n' | "$emu" --aggregate 3 > "$dir/acks"
+check "every corrupted ACK is detected" \
+  [ "$(grep -c 'packet being corrupted' "$dir/acks")" = "$(grep -c 'corrupted ACK is received' "$dir/acks")" ]
+
+# user-029: timers share the sorted event list in the original emulator's
+# tie order, so GBN's counters are the original's (with glibc's rand)
+run gbn 3000 0.1 0.1 20 --protocol gbn
+check "GBN resends as the original emulator did" [ "$(value gbn 'number of packet resends')" = 31819 ]
+check "GBN delivers as the original emulator did" [ "$(value gbn 'number of messages delivered')" = 145 ]
+
+# user-030: no packet is used after its last reference is dropped, with the
+# pool off so the sanitizer sees each release (skipped without -fsanitize)
+if gcc -ansi -DNOPOOL -g -fsanitize=address,undefined -o "$dir/emulator-asan" \
+     emulator.c sr.c gbn.c consumer.c -pthread -lm 2> /dev/null; then
+  printf '3000\n0.2\n0.2\n2\n2\n0\n' | "$dir/emulator-asan" --cc --fec 3 --aggregate 3 \
+    --pacing --reorder 0.1,15 > "$dir/asan" 2>&1
+  printf '3000\n0.2\n0.2\n2\n2\n0\n' | "$dir/emulator-asan" --protocol gbn --ber 0.001 \
+    >> "$dir/asan" 2>&1
+  check "packets are not used after release" eval '! grep -q ERROR "$dir/asan"'
+else
+  echo "skip  packets are not used after release (no -fsanitize)"
+fi
+
+# user-031: a trace gives exactly its arrivals, and Poisson arrivals keep the mean interval
+seq 1 3 150 > "$dir/arrivals"
+run trace 3000 0 0 5 --arrivals trace --trace-file "$dir/arrivals"
+check "trace arrivals send one message per line" \
+  grep -q '^ after attempting to send 50 msgs' "$dir/trace"
+check "trace arrivals are all accounted for" [ "$(( $(value trace 'number of messages dropped') \
+  + $(value trace 'number of messages delivered') ))" = 50 ]
+run poisson 3000 0 0 5 --arrivals poisson
+check "Poisson arrivals average the given interval" \
+  awk '/terminated at time/ { t = $NF } END { exit !(t / 3000 > 4.75 && t / 3000 < 5.25) }' "$dir/poisson"
+run onoff1 3000 0.1 0.1 5 --arrivals onoff
+run onoff2 3000 0.1 0.1 5 --arrivals onoff
+check "on-off arrivals repeat with the seed" cmp -s "$dir/onoff1" "$dir/onoff2"
+
+# user-032: one binary runs either engine, and refuses options an engine lacks
+run sr 3000 0.1 0.1 20 --protocol sr
+check "SR and GBN run from one binary" eval '! cmp -s "$dir/sr" "$dir/gbn"'
+for option in --cc --pacing "--fec 3" "--aggregate 3" "--cwnd-log $dir/gbn.log" "--variant cc=1"; do
+  run refused 10 0 0 5 --protocol gbn $option
+  check "GBN refuses ${option%% *}" grep -q 'does not implement' "$dir/refused"
+done
+
+# user-033: with trace arrivals nothing else draws random numbers, so
+# replaying a recording reproduces the recorded run exactly
+awk 'BEGIN { for (i = 1; i <= 2000; i++) print 4 * i }' > "$dir/every4"
+for channel in "" "--ber 0.001 --reorder 0.1,15"; do
+  run recorded 3000 0.2 0.2 5 --arrivals trace --trace-file "$dir/every4" \
+    --record-channel "$dir/channel" $channel
+  run replayed 3000 0.2 0.2 5 --arrivals trace --trace-file "$dir/every4" \
+    --replay-channel "$dir/channel" $channel
+  check "replaying a recorded ${channel:+noisy }channel repeats the run" \
+    cmp -s "$dir/recorded" "$dir/replayed"
+done
+run replayed 3000 0.2 0.2 5 --replay-channel "$dir/channel" --record-channel "$dir/again"
+check "replaying refuses to record as well" grep -q '^usage' "$dir/replayed"
+
+# user-034: an early stop meets its precision, and seeds are run and averaged reproducibly
+run precise 100000 0.1 0.1 5 --precision 0.05
+check "a precise run stops early" grep -q '^stopped early' "$dir/precise"
+check "every estimate is within the precision" \
+  awk '/\+\/-/ { n++; for (i = 2; i < NF; i++) if ($i == "+/-" && $(i+1) > 0.05 * $(i-1)) bad = 1 }
+       END { exit bad || n != 3 }' "$dir/precise"
+run seeds1 3000 0.1 0.1 5 --seeds 3
+run seeds2 3000 0.1 0.1 5 --seeds 3
+check "multi-seed runs repeat" cmp -s "$dir/seeds1" "$dir/seeds2"
+check "multi-seed goodput is the mean of the seeds" \
+  awk '/^seed / { sum += $8; n++ } /^goodput/ { mean = $6 }
+       END { d = sum / n - mean; exit !(n == 3 && d * d < 4e-12) }' "$dir/seeds1"
+
+# user-035: a restored run carries on exactly as the saved one did, and a
+# variant that changes nothing forks into the same run
+features="--cc --fec 3 --aggregate 3 --ber 0.001 --reorder 0.1,15 --pacing"
+printf '3000\n0.1\n0.1\n2\n5\n2\n' | "$emu" $features --checkpoint-at 5000 "$dir/snap" > "$dir/saved"
+"$emu" $features --restore "$dir/snap" > "$dir/restored"
+sed '1,/CHECKPOINT: state/d' "$dir/saved" > "$dir/saved.rest"
+sed '1,2d' "$dir/restored" > "$dir/restored.rest"
+check "a restored run traces as the saved run did" cmp -s "$dir/saved.rest" "$dir/restored.rest"
+"$emu" $features --restore "$dir/snap" --variant loss=0.1 > "$dir/forked"
+check "a variant that changes nothing repeats its parent" \
+  awk '/^-----  Variant/ { v = 1; next } /^number of/ { if (v) b[++m] = $0; else a[++n] = $0 }
+       END { if (n == 0 || n != m) exit 1; for (i = 1; i <= n; i++) if (a[i] != b[i]) exit 1 }' \
+  "$dir/forked"
+
+# user-036: a row every interval, and the columnar file holds what the CSV does
+run csv 3000 0.1 0.1 5 --sample 100 "$dir/samples.csv" --sample-format csv
+run columns 3000 0.1 0.1 5 --sample 100 "$dir/samples.bin"
+check "the sampler writes a row every interval" \
+  awk -F, 'NR == 1 { ok = $1 == "time" && NF == 11; next }
+           { if ($1 != 100 * (NR - 1) || $5 < delivered || $3 > 6) ok = 0; delivered = $5 }
+           END { exit !(ok && NR > 100) }' "$dir/samples.csv"
+rows=$(( $(wc -l < "$dir/samples.csv") - 1 ))
+header=$(awk -F, 'NR == 1 { n = 4 + 4 + 6; for (i = 2; i <= NF; i++) n += length($i) + 2; print n }' \
+  "$dir/samples.csv")
+od -An -v -t d4 -j $((header + 4 + 8 * rows)) "$dir/samples.bin" | tr -s ' ' '\n' | sed '/^$/d' \
+  > "$dir/columns.ints"
+awk -F, 'NR > 1 { for (i = 2; i <= NF; i++) v[i, NR] = $i }
+         END { for (i = 2; i <= NF; i++) for (r = 2; r <= NR; r++) print v[i, r] }' \
+  "$dir/samples.csv" > "$dir/csv.ints"
+check "the columnar samples match the CSV" \
+  eval '[ -s "$dir/csv.ints" ] && cmp -s "$dir/columns.ints" "$dir/csv.ints"'
+check "the columnar block counts its rows" \
+  [ "$(od -An -t d4 -j "$header" -N 4 "$dir/samples.bin" | tr -d ' ')" = "$rows" ]
+
+# user-037: profiling changes no result, and no routine's self time passes its total
+gcc -ansi -Wall -pedantic -DPROFILE -o "$dir/emulator-profile" \
+  emulator.c sr.c gbn.c consumer.c -pthread -lm || exit 1
+run plain 3000 0.1 0.1 5
+printf '3000\n0.1\n0.1\n2\n5\n0\n' | "$dir/emulator-profile" > "$dir/profiled"
+check "profiling leaves the results alone" \
+  eval '[ "$(counters plain)" = "$(counters profiled | sed "/^profile/,\$d")" ]'
+check "the profile's self times are within its totals" \
+  awk '/^profile/ { p = 1; next } p && $(NF-4) ~ /^[0-9]+$/ { n++; if ($(NF-1) > $(NF-3)) bad = 1 }
+       END { exit bad || n < 8 }' "$dir/profiled"
+
+# user-038: drop-tail and RED queues keep to their bounds, and a link with
+# no waiting room still carries a packet at a time
+for queue in 0 3; do
+  run link$queue 3000 0 0 2 --bandwidth 5 --queue $queue --sample 10 "$dir/link$queue.csv" \
+    --sample-format csv
+  check "a queue of $queue never holds more" \
+    awk -F, -v q=$queue 'NR > 1 && $10 > q { bad = 1 } END { exit bad || NR < 2 }' "$dir/link$queue.csv"
+  check "a queue of $queue drops and delivers" eval \
+    'at_least "$(value link$queue "number of messages delivered")" 1 &&
+     grep -q "^link A->B: .* [1-9][0-9]* packets dropped" "$dir/link$queue"'
+done
+run red 3000 0 0 2 --cc --bandwidth 5 --queue 64 --red 2,6,0.5 --sample 10 "$dir/red.csv" \
+  --sample-format csv
+check "RED drops before the average passes its upper threshold" \
+  awk -F, 'NR > 1 && $10 > m { m = $10 } END { exit !(NR > 1 && m <= 6) }' "$dir/red.csv"
+
+# user-039: bit errors never reach the application, Gilbert-Elliott losses
+# come in longer bursts than independent ones, and reordered packets arrive intact
+run ber-sr 20000 0 0 2 --ber 0.004 --aggregate 3
+run ber-gbn 20000 0 0 2 --ber 0.004 --protocol gbn
+for protocol in sr gbn; do
+  check "$protocol delivers nothing damaged by bit errors" eval \
+    '[ "$(value ber-$protocol "number of them unlike")" = 0 ] &&
+     at_least "$(value ber-$protocol "number of messages delivered")" 1'
+done
+run gilbert 3000 0.1 0 5 --gilbert 0.02,0.3,0,0.6
+run independent 3000 0.1 0 5 --gilbert 1,0,0.1,0.1
+check "Gilbert-Elliott losses come in bursts" eval \
+  'at_least "$(value gilbert "loss bursts from A")" 1 &&
+   at_least "$(sed -n "s/^loss bursts from A.*mean length \([0-9.]*\).*/\1/p" "$dir/gilbert")" \
+     "$(sed -n "s/^loss bursts from A.*mean length \([0-9.]*\).*/\1/p" "$dir/independent") + 0.3"'
+run reorder 3000 0.1 0.1 5 --reorder 0.2,15
+check "reordered packets arrive intact" eval \
+  'at_least "$(value reorder "packets from A held back")" 1 &&
+   [ "$(value reorder "number of them unlike")" = 0 ]'
+
+# user-040: the pacer holds packets back and so shortens the bottleneck queue
+run burst 3000 0 0 2 --cc --bandwidth 10 --queue 2 --propagation 3
+run paced 3000 0 0 2 --cc --bandwidth 10 --queue 2 --propagation 3 --pacing
+check "the pacer holds new packets back" at_least "$(value paced 'number of new packets held back')" 1
+check "pacing shortens the queueing delay" eval \
+  'at_least "$(sed -n "s/^link A->B:.*queueing delay \([0-9.]*\).*/\1/p" "$dir/burst")" \
+     "$(sed -n "s/^link A->B:.*queueing delay \([0-9.]*\).*/\1/p" "$dir/paced") + 0.1"'
+
+# user-041: the window keeps the ring from filling, a ring roomier than
+# the window changes nothing, and a ring too small for a packet is refused
+# (the thread runs at the host's pace, so only these hold run to run)
+run small 20000 0.1 0.1 1 --consumer 4 --aggregate 3
+check "the window keeps the consumer ring from filling" eval \
+  'grep -q ", 0 found the ring full" "$dir/small" &&
+   [ "$(value small "number of them unlike")" = 0 ]'
+run roomy 3000 0.1 0.1 5 --consumer 64 --aggregate 3
+run direct 3000 0.1 0.1 5 --aggregate 3
+check "a ring roomier than the window changes nothing" \
+  eval '[ "$(counters roomy | grep -v "^delivery batches")" = "$(counters direct)" ]'
+run tiny 100 0 0 5 --consumer 2 --aggregate 3
+check "a ring smaller than a packet is refused" grep -q 'must hold at least 3' "$dir/tiny"
+
+# user-042: sequence numbers that wrap past 0 or past 2^31 early in the
+# run change nothing, since nothing draws on their values
+for start in -150 0x7fffff6a; do
+  gcc -ansi -Wall -pedantic -DFIRSTSEQ=$start -o "$dir/emulator-wrap" \
+    emulator.c sr.c gbn.c consumer.c -pthread -lm || exit 1
+  for options in "--cc --fec 3 --aggregate 3" "--fec 2 --pacing --bandwidth 10 --queue 2" \
+                 "--protocol gbn"; do
+    run unwrapped 3000 0.2 0.2 5 $options
+    printf '3000\n0.2\n0.2\n2\n5\n0\n' | "$dir/emulator-wrap" $options > "$dir/wrapped"
+    check "starting at $start wraps safely with $options" \
+      eval '[ "$(counters unwrapped)" = "$(counters wrapped)" ]'
+  done
+done
+
+exit $failed
@@ -0,0 +1,136 @@
+/* ******************************************************************
+   Application consumer thread.
+
+   B's event handler is the only producer and the application thread
+   the only consumer of a ring of struct msg slots.  head counts the
+   messages published and is written by the producer only, tail counts
+   those taken and is written by the consumer only, so each side needs
+   just an acquire load of the other's index and a release store of its
+   own; no locks.  The producer copies a whole batch before publishing
+   it with one store, so the consumer sees messages a run at a time.
+
+   Kept apart from emulator.c because <pthread.h> declares time(),
+   which the emulator uses as the name of its clock.
+**********************************************************************/
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "emulator.h"
+#include "consumer.h"
+
+static struct {
+  unsigned long head;          /* messages published, written by the producer */
+  char pad[64];                /* keep head and tail on separate cache lines */
+  unsigned long tail;          /* messages taken, written by the consumer */
+  char pad2[64];
+  struct msg *slots;
+  unsigned long size;          /* a power of 2 */
+} ring;
+
+static int stopping;           /* set once the ring is drained for good */
+static int running;
+static pthread_t consumer;
+static unsigned long checksum; /* folds the bytes taken: the application's work */
+
+static void *consume(void *arg)
+{
+  unsigned long head, tail = ring.tail;
+  int i;
+
+  while (1) {
+    head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+        return NULL;
+      sched_yield();
+      continue;
+    }
+    for (; tail != head; tail++)
+      for (i=0; i<MSGSIZE; i++)
+        checksum = checksum * 31 + ring.slots[tail & (ring.size - 1)].data[i];
+    __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+  }
+}
+
+/* Start the thread on an empty ring.  A forked child calls this again:
+   the parent's thread did not come along, its flags did. */
+void consumer_start(int slots)
+{
+  if (slots == 0)
+    return;
+  if (ring.slots == NULL) {
+    ring.slots = malloc(slots * sizeof(struct msg));
+    if (ring.slots == NULL) {
+      printf("memory allocation for the consumer ring failed.");
+      exit(EXIT_FAILURE);
+    }
+    ring.size = slots;
+  }
+  stopping = 0;
+  if (pthread_create(&consumer, NULL, consume, NULL) != 0) {
+    printf("unable to start the consumer thread\n");
+    exit(EXIT_FAILURE);
+  }
+  running = 1;
+}
+
+void consumer_drain(void)
+{
+  if (!running)
+    return;
+  while (__atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) != ring.head)
+    sched_yield();
+}
+
+void consumer_stop(void)
+{
+  if (!running)
+    return;
+  consumer_drain();
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(consumer, NULL);
+  running = 0;
+}
+
+int consumer_backlog(void)
+{
+  if (!running)
+    return 0;
+  return (int)(ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE));
+}
+
+/* B never waits on a ring it keeps from filling, so on a single CPU the
+   thread would not run at all; let it take what is waiting first */
+void consumer_yield(void)
+{
+  if (consumer_backlog() > 0)
+    sched_yield();
+}
+
+/* copy nmsgs messages into the ring, publishing early whenever it fills */
+int consumer_put(char *data, int nmsgs)
+{
+  unsigned long head = ring.head, tail;
+  int waited = 0;
+
+  tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+  while (nmsgs > 0) {
+    if (head - tail == ring.size) {
+      __atomic_store_n(&ring.head, head, __ATOMIC_RELEASE);
+      waited = 1;
+      do {
+        sched_yield();
+        tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+      } while (head - tail == ring.size);
+    }
+    memcpy(ring.slots[head & (ring.size - 1)].data, data, MSGSIZE);
+    data += MSGSIZE;
+    head++;
+    nmsgs--;
+  }
+  __atomic_store_n(&ring.head, head, __ATOMIC_RELEASE);
+  return waited;
+}
@@ -0,0 +1,8 @@
+/* Lock-free single-producer single-consumer ring between B's event
+   handler and an application thread, see consumer.c */
+extern void consumer_start(int);      /* ring slots (a power of 2), 0 for none */
+extern void consumer_stop(void);      /* drain the ring and join the thread */
+extern void consumer_drain(void);     /* wait until the thread has taken everything */
+extern int consumer_backlog(void);    /* messages published and not yet taken */
+extern void consumer_yield(void);     /* give the thread a turn if it has work */
+extern int consumer_put(char *, int); /* data, number of messages; non-zero if it had to wait */
@@ -40,10 +40,20 @@
    - fixed C style to adhere to current programming style
 
    ********************************************************************* */
+#define _POSIX_C_SOURCE 200112L   /* fork and pipe for --seeds */
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <limits.h>
 #include "emulator.h"
+#include "consumer.h"
 #include "gbn.h"
+#include "sr.h"
 
 struct event {
   float evtime;           /* event time */
@@ -52,26 +62,48 @@ struct event {
   struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
   struct event *prev;
   struct event *next;
+  int timerid;            /* which of the entity's timers (timers only) */
 };
 
-struct event *evlist = NULL;   /* the event list */
+struct event *evlist = NULL;   /* the event list, in time order, timers included */
+static int nevlist;            /* events in evlist */
+static int ninflight;          /* of which packets on their way */
+static struct event *timers[2][NTIMERS]; /* running timers of A and B, NULL if stopped */
 
 /* possible events: */
 #define  TIMER_INTERRUPT 0  
 #define  FROM_LAYER5     1
 #define  FROM_LAYER3     2
+#define  NEVTYPES        3  /* event types above */
 
 #define  OFF             0
 #define  ON              1
 
 int TRACE = 3;
 
+/* protocol engines that can be selected with --protocol */
+static struct protocol *protocols[] = { &sr_protocol, &gbn_protocol, NULL };
+static struct protocol *proto = &sr_protocol;   /* engine being simulated */
+static void *protostate;                        /* its state */
+
 /* statistics updated by GBN */
 int window_full;   /* count of the number of messages dropped due to full window */
 int total_ACKs_received;
 int packets_resent;       /* count of the number of packets resent  */
 int new_ACKs;           /* count of the number of acks correctly received */
 int packets_received;  /* count of the packets received by receiver */
+int fec_parity_sent;   /* count of the FEC parity packets sent */
+int fec_recovered;     /* count of the packets recovered from FEC parity */
+int aggregate_packets;  /* count of the new data packets built */
+int aggregate_messages; /* count of the messages packed into them */
+int paced_packets;      /* count of the new packets A's pacer held back */
+
+/* protocol options, set from the command line */
+int congestion_control = 0;
+char *cwnd_logfile = NULL;
+int fec_group = 0;
+int aggregate = 0;
+int pacing = 0;
 
 /* statistics updated by emulator */
 static int packets_lost;  
@@ -90,6 +122,8 @@ static float lambda;        /* arrival rate of messages from layer 5 */
 static int   ntolayer3;           /* number sent into layer 3 */
 static int   nlost;               /* number lost in media */
 static int ncorrupt;              /* number corrupted by media*/
+static float lastarrival[2];      /* last in-order arrival of a packet from A and from B */
+static unsigned long rng_draws;   /* jimsrand() calls since the last srand() */
 
 /****************************************************************************/
 /* jimsrand(): return a double in range [0,1].  The routine below is used to */
@@ -99,81 +133,1491 @@ static int ncorrupt;              /* number corrupted by media*/
 float get_sim_time(void) {
     return time;  /* Assuming `time` is a global variable in emulator.c */
 }
-double jimsrand(void) 
+double jimsrand(void) 
+{
+  double mmm = RAND_MAX;     /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
+  double x;                   
+  x = rand()/mmm;            /* x should be uniform in [0,1] */
+  rng_draws++;
+  if (TRACE > 3)
+    trace("RANDOM NUMBER GENERAION CALLED: %f\n", x);
+  return(x);
+}  
+
+/********************* PROFILER *******************/
+/* Built with -DPROFILE, each event dispatch in the main loop and each */
+/* emulator service routine reads the CPU's cycle counter on the way  */
+/* in and out, and the counts and cycles are printed at the end.      */
+/* Total times include nested calls: tolayer3 is inside the           */
+/* fromlayer3 dispatch that called it, insertevent inside tolayer3.   */
+/* Self times leave the nested calls out, so a dispatch's self time   */
+/* is the protocol's own code and trace's is all TRACE output.        */
+/* Units are TSC cycles on x86, generic timer ticks on aarch64 and    */
+/* microseconds elsewhere.  Without PROFILE the hooks compile to      */
+/* nothing.                                                           */
+/*****************************************************/
+
+#ifdef PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PROF_UNIT "cycles"
+#elif defined(__aarch64__)
+#define PROF_UNIT "ticks"
+#else
+#define PROF_UNIT "microseconds"
+#include <sys/time.h>
+#endif
+
+/* the dispatch of each event type at A and B, then the routines */
+#define PROF_DISPATCH(type, entity)  ((type) * 2 + (entity))
+#define PROF_INSERTEVENT (NEVTYPES * 2)
+#define PROF_NEXTEVENT   (PROF_INSERTEVENT + 1)
+#define PROF_STARTTIMER  (PROF_INSERTEVENT + 2)
+#define PROF_STOPTIMER   (PROF_INSERTEVENT + 3)
+#define PROF_TOLAYER3    (PROF_INSERTEVENT + 4)
+#define PROF_TOLAYER5    (PROF_INSERTEVENT + 5)
+#define PROF_ARRIVAL     (PROF_INSERTEVENT + 6)
+#define PROF_TRACE       (PROF_INSERTEVENT + 7)
+#define NPROF            (PROF_INSERTEVENT + 8)
+#define PROF_DEPTH       32
+
+static char *prof_names[] = {
+  "timerinterrupt at A", "timerinterrupt at B",
+  "fromlayer5 at A", "fromlayer5 at B",
+  "fromlayer3 at A", "fromlayer3 at B",
+  "insertevent", "nextevent", "starttimer", "stoptimer",
+  "tolayer3", "tolayer5", "generate_next_arrival", "trace"
+};
+/* fails to compile unless there is a name for every slot, which catches
+   an event type added without its dispatch names */
+typedef char prof_names_complete[sizeof(prof_names) / sizeof(prof_names[0]) == NPROF ? 1 : -1];
+static unsigned long prof_calls[NPROF];
+static double prof_cycles[NPROF];
+static double prof_self[NPROF];     /* prof_cycles less the nested entries' */
+static struct {
+  unsigned long start;              /* counter at entry */
+  double nested;                    /* cycles of the entries made inside it */
+} prof_stack[PROF_DEPTH];
+static int prof_depth;
+
+static unsigned long read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int lo, hi;
+
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((unsigned long)hi << 16 << 16) | lo;   /* hi is lost on 32 bit, deltas still fit */
+#elif defined(__aarch64__)
+  unsigned long v;
+
+  __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (v));
+  return v;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (unsigned long)tv.tv_sec * 1000000UL + tv.tv_usec;
+#endif
+}
+
+void prof_enter(void)
+{
+  if (prof_depth < PROF_DEPTH) {
+    prof_stack[prof_depth].nested = 0;
+    prof_stack[prof_depth].start = read_cycles();
+  }
+  prof_depth++;
+}
+
+void prof_leave(int where)
+{
+  unsigned long now = read_cycles();
+  double cycles;
+
+  prof_depth--;
+  if (prof_depth >= PROF_DEPTH)
+    return;
+  cycles = now - prof_stack[prof_depth].start;
+  if (prof_depth > 0)
+    prof_stack[prof_depth - 1].nested += cycles;
+  if (where >= 0 && where < NPROF) {
+    prof_calls[where]++;
+    prof_cycles[where] += cycles;
+    prof_self[where] += cycles - prof_stack[prof_depth].nested;
+  }
+}
+
+void print_profile(void)
+{
+  unsigned long start;
+  double overhead;
+  int i;
+
+  start = read_cycles();   /* cost of one empty enter and leave */
+  for (i=0; i<1000; i++) {
+    prof_enter();
+    prof_depth--;
+    read_cycles();
+  }
+  overhead = (read_cycles() - start) / 1000.0;
+
+  printf("profile (%s, total including nested calls, self without; "
+         "about %.0f per call is the profiler's own):\n", PROF_UNIT, overhead);
+  printf("  %-24s %12s %16s %12s %16s %12s\n", "where", "calls", "total", "mean", "self", "mean");
+  for (i=0; i<NPROF; i++)
+    if (prof_calls[i] > 0)
+      printf("  %-24s %12lu %16.0f %12.1f %16.0f %12.1f\n", prof_names[i], prof_calls[i],
+             prof_cycles[i], prof_cycles[i] / prof_calls[i],
+             prof_self[i], prof_self[i] / prof_calls[i]);
+}
+
+#define PROF_ENTER()       prof_enter()
+#define PROF_LEAVE(where)  prof_leave(where)
+
+#else
+
+#define PROF_ENTER()
+#define PROF_LEAVE(where)
+
+#endif
+
+/* printf for the TRACE output, which the profiler counts on its own */
+void trace(char *format, ...)
+{
+  va_list args;
+
+  PROF_ENTER();
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  PROF_LEAVE(PROF_TRACE);
+}
+
+/********************* EVENT HANDLINE ROUTINES *******/
+/*  The next set of routines handle the event list   */
+/*****************************************************/
+
+void insertevent(struct event *p)
+{
+  struct event *q,*qold;
+
+  PROF_ENTER();
+  if (TRACE>2) {
+    trace("            INSERTEVENT: time is %f\n",time);
+    trace("            INSERTEVENT: future time will be %f\n",p->evtime); 
+  }
+  nevlist++;
+  if (p->evtype == FROM_LAYER3)
+    ninflight++;
+  q = evlist;     /* q points to front of list in which p struct inserted */
+  if (q==NULL) {   /* list is empty */
+    evlist=p;
+    p->next=NULL;
+    p->prev=NULL;
+  }
+  else {
+    for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
+      qold=q; 
+    if (q==NULL) {   /* end of list */
+      qold->next = p;
+      p->prev = qold;
+      p->next = NULL;
+    }
+    else if (q==evlist) { /* front of list */
+      p->next=evlist;
+      p->prev=NULL;
+      p->next->prev=p;
+      evlist = p;
+    }
+    else {     /* middle of list */
+      p->next=q;
+      p->prev=q->prev;
+      q->prev->next=p;
+      q->prev=p;
+    }
+  }
+  PROF_LEAVE(PROF_INSERTEVENT);
+}
+
+
+/* unlink p from evlist */
+void removeevent(struct event *p)
+{
+  nevlist--;
+  if (p->evtype == FROM_LAYER3)
+    ninflight--;
+  if (p->prev != NULL)
+    p->prev->next = p->next;
+  else
+    evlist = p->next;
+  if (p->next != NULL)
+    p->next->prev = p->prev;
+}
+
+/* remove and return the next event to simulate, NULL when there are none */
+struct event *nextevent(void)
+{
+  struct event *p;
+
+  PROF_ENTER();
+  p = evlist;
+  if (p != NULL) {
+    removeevent(p);
+    if (p->evtype == TIMER_INTERRUPT)
+      timers[p->eventity][p->timerid] = NULL;
+  }
+  PROF_LEAVE(PROF_NEXTEVENT);
+  return p;
+}
+
+/********************* ARRIVAL GENERATORS *******/
+/* Each generator returns the time of the next message from layer 5,  */
+/* or a negative time once it has no more messages to give.  All keep */
+/* a long run mean of one message every lambda time units, except the */
+/* trace generator which replays recorded times.                      */
+/*****************************************************/
+
+static char *arrival_kind = "uniform";  /* --arrivals */
+static double onoff_on = 100.0;         /* mean length of an on period */
+static double onoff_off = 100.0;        /* mean length of an off period */
+static double onoff_end;                /* end of the current on period */
+static char *trace_name = NULL;         /* recorded arrival times, one per line */
+static FILE *trace_file;
+
+/* exponentially distributed with the given mean */
+double expovariate(double mean)
+{
+  double u;
+
+  do
+    u = jimsrand();
+  while (u >= 1.0);
+  return -mean * log(1.0 - u);
+}
+
+double uniform_arrival(void)
+{
+  return time + lambda*jimsrand()*2;  /* uniform on [0,2*lambda], mean lambda */
+}
+
+double poisson_arrival(void)
+{
+  return time + expovariate(lambda);
+}
+
+/* Bursts: Poisson arrivals during exponentially distributed on periods,
+   none during the off periods between them. */
+double onoff_arrival(void)
+{
+  double t = time;
+
+  for (;;) {
+    if (t < onoff_end) {
+      t += expovariate(lambda * onoff_on / (onoff_on + onoff_off));
+      if (t < onoff_end)
+        return t;
+      t = onoff_end;
+    }
+    t += expovariate(onoff_off);
+    onoff_end = t + expovariate(onoff_on);
+  }
+}
+
+/* Replay a trace of arrival times.  The file is streamed through a
+   large stdio buffer, so traces of any length use constant memory. */
+double trace_arrival(void)
+{
+  double t;
+
+  if (trace_file == NULL || fscanf(trace_file, "%lf", &t) != 1)
+    return -1.0;
+  if (t < time)   /* times must not go backwards */
+    t = time;
+  return t;
+}
+
+struct arrivalgen {
+  char *name;
+  double (*next)(void);
+};
+
+static struct arrivalgen arrivalgens[] = {
+  { "uniform", uniform_arrival },
+  { "poisson", poisson_arrival },
+  { "onoff",   onoff_arrival },
+  { "trace",   trace_arrival },
+  { NULL,      NULL }
+};
+
+static struct arrivalgen *arrivalgen = &arrivalgens[0];
+
+void init_arrivals(void)
+{
+  static char tracebuf[1 << 20];
+
+  for (arrivalgen = arrivalgens; arrivalgen->name != NULL; arrivalgen++)
+    if (strcmp(arrivalgen->name, arrival_kind) == 0)
+      break;
+  if (arrivalgen->name == NULL) {
+    printf("unknown arrival generator %s\n", arrival_kind);
+    exit(EXIT_FAILURE);
+  }
+  if (arrivalgen->next == onoff_arrival)
+    onoff_end = expovariate(onoff_on);
+  if (arrivalgen->next == trace_arrival) {
+    if (trace_name == NULL || (trace_file = fopen(trace_name, "r")) == NULL) {
+      printf("unable to open arrival trace %s\n", trace_name ? trace_name : "(none given)");
+      exit(EXIT_FAILURE);
+    }
+    setvbuf(trace_file, tracebuf, _IOFBF, sizeof(tracebuf));
+  }
+}
+
+void generate_next_arrival(void)
+{
+  double t;
+  struct event *evptr;
+
+  PROF_ENTER();
+  if (TRACE>2)
+    trace("          GENERATE NEXT ARRIVAL: creating new arrival\n");
+ 
+  t = arrivalgen->next();
+  if (t < 0) {
+    if (TRACE>2)
+      trace("          GENERATE NEXT ARRIVAL: arrival trace is exhausted\n");
+    PROF_LEAVE(PROF_ARRIVAL);
+    return;
+  }
+  evptr = malloc(sizeof(struct event));
+  if (evptr == 0) {
+    printf("memory allocation for event failed.");
+    exit(EXIT_FAILURE);
+  }
+  evptr->evtime =  t;
+  evptr->evtype =  FROM_LAYER5;
+  if (BIDIRECTIONAL && (jimsrand()>0.5) )
+    evptr->eventity = B;
+  else
+    evptr->eventity = A;
+  insertevent(evptr);
+  PROF_LEAVE(PROF_ARRIVAL);
+} 
+
+/******************** CHANNEL MODELS ***************/
+/* The channel deals each packet sent a fate: lost, or delivered     */
+/* after a delay, intact or corrupted.  Loss is independent with     */
+/* lossprob unless --gilbert gives a Gilbert-Elliott model: each     */
+/* direction is in a good or a bad state, loses with that state's    */
+/* probability and then may change state, so losses come in bursts. */
+/* Corruption hits payload[0], seqnum or acknum with corruptprob,    */
+/* the window standing in for an empty payload, unless --ber gives a */
+/* bit error rate, which flips each bit of the seqnum, acknum,       */
+/* checksum and payload independently.  There the window and length  */
+/* are left alone, as if protected by the link layer, since the      */
+/* receivers size their copies by length.  --reorder holds a         */
+/* packet back by up to a bound so that later ones may overtake it.  */
+/*****************************************************/
+
+#define FATE_DELIVERED 0
+#define FATE_LOST      1
+#define FATE_PAYLOAD   2   /* delivered with the payload corrupted */
+#define FATE_SEQNUM    3   /* delivered with the seqnum corrupted */
+#define FATE_ACKNUM    4   /* delivered with the acknum corrupted */
+#define FATE_BITS      5   /* delivered with the bits in flips flipped */
+#define FATE_LATE      0x40
+#define FATE_FROMB     0x80
+
+#define MAXFLIPS   16    /* most bits flipped in one packet */
+#define HEADERBITS 96    /* bits of seqnum, acknum and checksum */
+#define BURSTHIST  8     /* burst lengths counted one by one, the last also counts longer */
+
+struct fate {
+  int kind;
+  double delay;   /* time beyond the 1 unit minimum after the previous arrival */
+  double late;    /* extra time held back, 0 if not reordered */
+  int nflips;     /* for FATE_BITS: bits flipped, numbered over the */
+  int flips[MAXFLIPS]; /* seqnum, acknum, checksum, then the payload */
+};
+
+struct bursts {
+  int run;                 /* packets lost in a row so far */
+  int count;               /* bursts ended */
+  int lost;                /* packets lost in them */
+  int longest;
+  int hist[BURSTHIST];
+};
+
+static int gilbert = 0;                /* --gilbert PGB,PBG,LG,LB */
+static double ge_gb, ge_bg;            /* chance of going bad and of going good */
+static double ge_lossgood, ge_lossbad; /* chance of a loss in each state */
+static int ge_bad[2];                  /* each sender's direction is in the bad state */
+static double ber = 0.0;               /* --ber, 0 for field corruption */
+static double reorder_prob = 0.0;      /* --reorder P,D */
+static double reorder_bound;
+static int reordered[2];               /* packets held back, per sender */
+static struct bursts bursts[2];        /* loss bursts, per sender */
+
+/* note whether the next packet in a direction was lost, ending a burst if not */
+static void count_burst(int AorB, int lost)
+{
+  struct bursts *b = &bursts[AorB];
+
+  if (lost) {
+    b->run++;
+    return;
+  }
+  if (b->run == 0)
+    return;
+  b->count++;
+  b->lost += b->run;
+  if (b->run > b->longest)
+    b->longest = b->run;
+  b->hist[(b->run < BURSTHIST ? b->run : BURSTHIST) - 1]++;
+  b->run = 0;
+}
+
+/* pick the bits of an nbits packet that the bit error rate flips, */
+/* jumping a geometric number of bits between one error and the next */
+static void draw_flips(int nbits, struct fate *f)
+{
+  double skip;
+  int pos = -1;
+
+  f->nflips = 0;
+  while (f->nflips < MAXFLIPS) {
+    skip = floor(log(1.0 - jimsrand()) / log(1.0 - ber));
+    if (pos + 1 + skip >= nbits)
+      break;
+    pos += 1 + (int)skip;
+    f->flips[f->nflips++] = pos;
+  }
+}
+
+/* apply a FATE_BITS fate to a packet */
+static void flip_bits(struct pkt *packet, struct fate *f)
+{
+  int *header[3];
+  int i, bit;
+
+  header[0] = &packet->seqnum;
+  header[1] = &packet->acknum;
+  header[2] = &packet->checksum;
+  for (i=0; i<f->nflips; i++) {
+    bit = f->flips[i];
+    if (bit < HEADERBITS)
+      *header[bit / 32] = (int)((unsigned)*header[bit / 32] ^ (1U << (bit % 32)));
+    else
+      packet->payload[(bit - HEADERBITS) / 8] ^= 1 << ((bit - HEADERBITS) % 8);
+  }
+}
+
+/******************** CHANNEL RECORD AND REPLAY ***************/
+/* The fate the channel deals each packet (lost, corrupted field,    */
+/* delay) can be recorded to a file and replayed later in place of   */
+/* the random draws, per direction, so different protocols see the   */
+/* same loss pattern.  A replaying channel draws no random numbers,  */
+/* which also leaves the arrival process identical between replays.  */
+/* File: the magic "CHN2", then per packet one byte (FATE_FROMB |    */
+/* FATE_LATE | a FATE_ kind) followed, unless lost, by the delay over */
+/* the 1 unit minimum as a native double, for FATE_BITS a count byte  */
+/* and that many native int bit numbers, and if FATE_LATE the time    */
+/* held back as a float.  The delay is kept whole and apart from the  */
+/* minimum so a replay rounds the arrival time as the live run did.   */
+/*****************************************************/
+
+static char *record_name = NULL;   /* --record-channel */
+static char *replay_name = NULL;   /* --replay-channel */
+static FILE *record_file;
+static FILE *replay_file[2];       /* one read position per sending side */
+static int replay_wraps[2];        /* times a direction ran out and started over */
+
+static FILE *open_channel_file(char *name, char *mode)
+{
+  FILE *f;
+  char magic[4];
+
+  f = fopen(name, mode);
+  if (f == NULL) {
+    printf("unable to open channel file %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+  if (mode[0] == 'w')
+    fwrite("CHN2", 1, 4, f);
+  else if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "CHN2", 4) != 0) {
+    printf("%s is not a channel recording\n", name);
+    exit(EXIT_FAILURE);
+  }
+  return f;
+}
+
+void init_channel(void)
+{
+  if (record_name != NULL)
+    record_file = open_channel_file(record_name, "wb");
+  if (replay_name != NULL) {
+    replay_file[A] = open_channel_file(replay_name, "rb");
+    replay_file[B] = open_channel_file(replay_name, "rb");
+  }
+}
+
+/* next recorded fate of a packet sent by AorB, starting over at the end */
+static void replay_fate(int AorB, struct fate *f)
+{
+  FILE *in = replay_file[AorB];
+  int c, n, rewound = 0;
+  double delay;
+  float late;
+
+  for (;;) {
+    c = getc(in);
+    if (c == EOF) {
+      if (rewound) {
+        printf("channel recording %s has no packets sent by %c\n", replay_name, "AB"[AorB]);
+        exit(EXIT_FAILURE);
+      }
+      fseek(in, 4, SEEK_SET);
+      replay_wraps[AorB]++;
+      rewound = 1;
+      continue;
+    }
+    f->kind = c & ~(FATE_FROMB | FATE_LATE);
+    f->late = 0;
+    f->nflips = 0;
+    if (f->kind != FATE_LOST) {
+      if (fread(&delay, sizeof(delay), 1, in) != 1)
+        goto truncated;
+      f->delay = delay;
+      if (f->kind == FATE_BITS) {
+        n = getc(in);
+        if (n == EOF || n > MAXFLIPS
+            || fread(f->flips, sizeof(int), n, in) != (size_t)n)
+          goto truncated;
+        f->nflips = n;
+      }
+      if (c & FATE_LATE) {
+        if (fread(&late, sizeof(late), 1, in) != 1)
+          goto truncated;
+        f->late = late;
+      }
+    }
+    if (((c & FATE_FROMB) != 0) == (AorB == B))
+      return;
+  }
+
+ truncated:
+  printf("channel recording %s is truncated\n", replay_name);
+  exit(EXIT_FAILURE);
+}
+
+/* decide what the channel does to a packet sent by AorB */
+void channel_fate(int AorB, int nbits, struct fate *f)
+/* deal the fate of a packet of nbits bits that may be corrupted */
+{
+  int affected, lost;
+  float late;
+  double x;
+
+  if (replay_file[AorB] != NULL) {
+    replay_fate(AorB, f);
+    count_burst(AorB, f->kind == FATE_LOST);
+    return;
+  }
+
+  /* loss and corruption may be limited to one direction */
+  affected = !(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B);
+  f->kind = FATE_DELIVERED;
+  f->delay = 0;
+  f->late = 0;
+  f->nflips = 0;
+  if (gilbert && affected) {
+    lost = jimsrand() < (ge_bad[AorB] ? ge_lossbad : ge_lossgood);
+    if (jimsrand() < (ge_bad[AorB] ? ge_bg : ge_gb))
+      ge_bad[AorB] = !ge_bad[AorB];
+  }
+  else
+    lost = jimsrand() < lossprob && affected;
+  if (lost)
+    f->kind = FATE_LOST;
+  else {
+    f->delay = 9*jimsrand();
+    if (ber > 0.0) {
+      if (affected) {
+        draw_flips(nbits, f);
+        if (f->nflips > 0)
+          f->kind = FATE_BITS;
+      }
+    }
+    else if ((jimsrand() < corruptprob) && affected) {
+      if ( (x = jimsrand()) < .75)
+        f->kind = FATE_PAYLOAD;
+      else if (x < .875)
+        f->kind = FATE_SEQNUM;
+      else
+        f->kind = FATE_ACKNUM;
+    }
+    if (reorder_prob > 0.0 && jimsrand() < reorder_prob)
+      f->late = reorder_bound * jimsrand();
+  }
+  count_burst(AorB, lost);
+
+  if (record_file != NULL) {
+    putc(f->kind | (f->late > 0 ? FATE_LATE : 0) | (AorB == B ? FATE_FROMB : 0), record_file);
+    if (f->kind != FATE_LOST) {
+      fwrite(&f->delay, sizeof(f->delay), 1, record_file);
+      if (f->kind == FATE_BITS) {
+        putc(f->nflips, record_file);
+        fwrite(f->flips, sizeof(int), f->nflips, record_file);
+      }
+      if (f->late > 0) {
+        late = f->late;
+        fwrite(&late, sizeof(late), 1, record_file);
+      }
+    }
+  }
+}
+
+/********************* LINK MODEL *******************/
+/* With --bandwidth set, each direction is a link of that many bytes  */
+/* per time unit behind a FIFO queue, and a packet arrives one        */
+/* serialization time after the link is free for it plus a fixed      */
+/* propagation delay, instead of 1 to 10 units after the last packet. */
+/* The queue drops a packet when --queue packets are already waiting  */
+/* (drop-tail), or early with RED's probability once its average      */
+/* length passes the lower --red threshold.  Queue drops count as     */
+/* losses.  A packet lost or corrupted by the channel still takes its */
+/* turn on the link.  The queue is held as the transmission finish    */
+/* times of the packets in it, since with a FIFO link that is all     */
+/* that decides when each arrives.                                    */
+/*****************************************************/
+
+#define LINK_HEADER   20      /* header bytes: seqnum, acknum, checksum, window, length */
+#define LINK_MAXQUEUE 4096
+#define RED_WEIGHT    0.002   /* weight of each sample in RED's average */
+
+struct link {
+  double finish[LINK_MAXQUEUE+1];  /* end of transmission of each packet in the link, a ring */
+  int head, count;                 /* the packet at head is on the wire, the rest wait */
+  double avg;                      /* RED's average queue length */
+  double busy;                     /* time spent transmitting */
+  double waited;                   /* time packets spent queued */
+  int sent;                        /* packets put on the link */
+  int drops;                       /* packets the queue dropped */
+};
+
+static double link_bandwidth = 0.0;    /* --bandwidth, 0 leaves the link model off */
+static double link_propagation = 5.0;  /* --propagation */
+static int link_queue = 64;            /* --queue */
+static double red_min, red_max, red_pmax; /* --red, red_max 0 for drop-tail */
+static struct link links[2];           /* A's and B's outgoing link */
+
+/* forget the packets that finished transmission by time t */
+static void link_drain(struct link *l, double t)
+{
+  while (l->count > 0 && l->finish[l->head] <= t) {
+    l->head = (l->head + 1) % (LINK_MAXQUEUE+1);
+    l->count--;
+  }
+}
+
+/* packets waiting behind the one on the wire at time t */
+int link_waiting(int AorB, double t)
+{
+  struct link *l = &links[AorB];
+
+  link_drain(l, t);
+  return l->count > 0 ? l->count - 1 : 0;
+}
+
+/* queue a packet of bytes for transmission now; returns the time it  */
+/* arrives at the other side, or a negative time if the queue drops it */
+double link_send(int AorB, int bytes)
+{
+  struct link *l = &links[AorB];
+  double start, tx;
+  int waiting;
+
+  waiting = link_waiting(AorB, time);
+  if (red_max > 0.0) {
+    l->avg = (1 - RED_WEIGHT) * l->avg + RED_WEIGHT * waiting;
+    if (l->avg >= red_max
+        || (l->avg >= red_min
+            && jimsrand() < red_pmax * (l->avg - red_min) / (red_max - red_min))) {
+      l->drops++;
+      return -1.0;
+    }
+  }
+  /* an idle wire takes the packet even with no room to wait */
+  if (l->count > 0 && waiting >= link_queue) {
+    l->drops++;
+    return -1.0;
+  }
+
+  start = l->count > 0 ? l->finish[(l->head + l->count - 1) % (LINK_MAXQUEUE+1)] : time;
+  tx = bytes / link_bandwidth;
+  l->finish[(l->head + l->count) % (LINK_MAXQUEUE+1)] = start + tx;
+  l->count++;
+  l->busy += tx;
+  l->waited += start - time;
+  l->sent++;
+  return start + tx + link_propagation;
+}
+
+void init_link(void)
+{
+  memset(links, 0, sizeof(links));
+  if (link_bandwidth > 0.0 && (link_queue < 0 || link_queue > LINK_MAXQUEUE)) {
+    printf("link queue must be between 0 and %d packets\n", LINK_MAXQUEUE);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/********************* STATISTICS *******************/
+/* Running estimates of goodput, message delay and retransmission   */
+/* ratio by batch means: simulated time is cut into batches of equal */
+/* length, each batch gives one sample of every metric, and the 95%  */
+/* confidence interval comes from the spread of those samples.  The  */
+/* first batch is warm-up and is thrown away.  A message's delay     */
+/* runs from A accepting it to B handing it to layer 5.              */
+/*****************************************************/
+
+#define NMETRICS   3
+#define GOODPUT    0
+#define DELAY      1
+#define RETXRATIO  2
+#define MINBATCHES 10   /* batches needed before convergence is tested */
+
+static char *metric_names[NMETRICS] = {
+  "goodput (messages per time unit)", "message delay", "retransmission ratio"
+};
+
+struct estimate {
+  int n;                /* samples so far */
+  double sum, sumsq;
+};
+
+static double precision = 0.0;     /* --precision: stop once every CI half-width is within this fraction of its mean */
+static double batch_length = 0.0;  /* --batch: length of a batch, 0 for no batches */
+static unsigned seed = 9999;       /* --seed */
+static int nseeds = 1;             /* --seeds: independent runs made side by side */
+
+static struct estimate estimates[NMETRICS];
+static int converged;              /* run stopped early at the target precision */
+static int batch_number;
+static double batch_end;           /* end of the current batch */
+static int batch_delivered, batch_sent, batch_resent;  /* counters at its start */
+static double batch_delay;         /* delays seen in it */
+static int batch_ndelays;
+static double total_delay;         /* delays seen in the whole run */
+static int ndelays;
+
+struct accepted {
+  double time;                     /* when A took it */
+  char data[MSGSIZE];              /* what B should deliver for it */
+};
+static struct accepted *accepted;  /* each message still on its way, a ring */
+static int accepted_head, accepted_count, accepted_size;
+static int damaged_messages;       /* delivered messages unlike the one A took */
+
+double student_t(int df)
+/* two sided 95% quantile of Student's t distribution */
+{
+  static double t[30] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+  };
+
+  if (df < 1)
+    return 0.0;
+  if (df <= 30)
+    return t[df-1];
+  return 1.960;
+}
+
+void add_sample(struct estimate *e, double x)
+{
+  e->n++;
+  e->sum += x;
+  e->sumsq += x*x;
+}
+
+double estimate_mean(struct estimate *e)
+{
+  return e->n > 0 ? e->sum / e->n : 0.0;
+}
+
+double estimate_halfwidth(struct estimate *e)
+/* half-width of the 95% confidence interval around the mean */
+{
+  double mean, var;
+
+  if (e->n < 2)
+    return 0.0;
+  mean = e->sum / e->n;
+  var = (e->sumsq - e->n * mean * mean) / (e->n - 1);
+  if (var < 0.0)
+    var = 0.0;      /* rounding */
+  return student_t(e->n - 1) * sqrt(var / e->n);
+}
+
+void init_statistics(void)
+{
+  if (precision > 0.0 && batch_length <= 0.0)
+    batch_length = 100 * lambda;   /* about a hundred arrivals a batch */
+  memset(estimates, 0, sizeof(estimates));
+  converged = 0;
+  batch_number = 0;
+  batch_end = batch_length;
+  batch_delivered = batch_sent = batch_resent = 0;
+  batch_delay = 0.0;
+  batch_ndelays = 0;
+  total_delay = 0.0;
+  ndelays = 0;
+  accepted_head = accepted_count = 0;
+  damaged_messages = 0;
+}
+
+void message_accepted(char data[MSGSIZE])
+/* A took a message from layer 5; remember when, and what it was */
+{
+  struct accepted *grown;
+  int i;
+
+  if (accepted_count == accepted_size) {
+    grown = malloc((accepted_size ? 2*accepted_size : 64) * sizeof(struct accepted));
+    if (grown == NULL) {
+      printf("memory allocation for message times failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i=0; i<accepted_count; i++)
+      grown[i] = accepted[(accepted_head + i) % accepted_size];
+    free(accepted);
+    accepted = grown;
+    accepted_head = 0;
+    accepted_size = accepted_size ? 2*accepted_size : 64;
+  }
+  accepted[(accepted_head + accepted_count) % accepted_size].time = time;
+  memcpy(accepted[(accepted_head + accepted_count) % accepted_size].data, data, MSGSIZE);
+  accepted_count++;
+}
+
+void message_arrived(char data[MSGSIZE])
+/* B handed the oldest outstanding message to layer 5 */
+{
+  double delay;
+
+  if (accepted_count == 0) {
+    damaged_messages++;
+    return;
+  }
+  if (memcmp(data, accepted[accepted_head].data, MSGSIZE) != 0)
+    damaged_messages++;
+  delay = time - accepted[accepted_head].time;
+  accepted_head = (accepted_head + 1) % accepted_size;
+  accepted_count--;
+  total_delay += delay;
+  ndelays++;
+  batch_delay += delay;
+  batch_ndelays++;
+}
+
+int batch_check(void)
+/* close every batch that ended before the current time; returns 1 */
+/* once the run has reached the target precision */
+{
+  int m;
+
+  while (batch_length > 0.0 && time >= batch_end) {
+    if (batch_number > 0) {   /* batch 0 is warm-up */
+      add_sample(&estimates[GOODPUT], (messages_delivered - batch_delivered) / batch_length);
+      if (batch_ndelays > 0)
+        add_sample(&estimates[DELAY], batch_delay / batch_ndelays);
+      if (packets_sent > batch_sent)
+        add_sample(&estimates[RETXRATIO],
+                   (double)(packets_resent - batch_resent) / (packets_sent - batch_sent));
+    }
+    batch_number++;
+    batch_end += batch_length;
+    batch_delivered = messages_delivered;
+    batch_sent = packets_sent;
+    batch_resent = packets_resent;
+    batch_delay = 0.0;
+    batch_ndelays = 0;
+
+    if (precision > 0.0) {
+      for (m=0; m<NMETRICS; m++)
+        if (estimates[m].n < MINBATCHES
+            || estimate_halfwidth(&estimates[m]) > precision * fabs(estimate_mean(&estimates[m])))
+          break;
+      if (m == NMETRICS) {
+        converged = 1;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+void run_metrics(double value[NMETRICS])
+/* whole run values of the metrics, as one replication's result */
+{
+  value[GOODPUT] = time > 0.0 ? messages_delivered / time : 0.0;
+  value[DELAY] = ndelays > 0 ? total_delay / ndelays : 0.0;
+  value[RETXRATIO] = packets_sent > 0 ? (double)packets_resent / packets_sent : 0.0;
+}
+
+/********************* SAMPLER *******************/
+/* Every --sample interval of simulated time one row of the state is  */
+/* written out, as CSV or in a compact columnar form: the magic       */
+/* "SMPL", the column count, then each column's type ('d' double or   */
+/* 'i' int) and NUL-terminated name, then blocks of up to             */
+/* SAMPLE_BLOCK rows, each an int row count followed by every         */
+/* column's values for those rows in turn.  Memory stays one block.   */
+/* A sample shows the state just before the first event at or after   */
+/* its time.                                                          */
+/*****************************************************/
+
+#define SAMPLE_BLOCK 1024
+#define SAMPLE_COLS  10     /* int columns, after the time */
+
+static char *sample_columns[SAMPLE_COLS] = {
+  "inflight",   /* packets in the channel */
+  "window",     /* packets A has sent and not had acknowledged */
+  "backlog",    /* messages A accepted and B has not delivered */
+  "delivered", "resent", "lost", "corrupted",
+  "events",     /* events pending, timers included */
+  "queue_a", "queue_b"  /* packets waiting in A's and B's link queue */
+};
+
+static double sample_interval = 0.0;   /* --sample T FILE */
+static char *sample_name = NULL;
+static char *sample_format = "columns"; /* --sample-format: columns or csv */
+static FILE *sample_file;
+static double sample_next;             /* time of the next sample */
+static double sample_time[SAMPLE_BLOCK];
+static int sample_values[SAMPLE_COLS][SAMPLE_BLOCK];
+static int sample_rows;                /* rows held, not yet written */
+
+static int sample_csv(void)
+{
+  return strcmp(sample_format, "csv") == 0;
+}
+
+void init_sampler(void)
+{
+  int i, n;
+
+  if (sample_name == NULL)
+    return;
+  sample_file = fopen(sample_name, sample_csv() ? "w" : "wb");
+  if (sample_file == NULL) {
+    printf("unable to open sample file %s\n", sample_name);
+    exit(EXIT_FAILURE);
+  }
+  if (sample_csv()) {
+    fprintf(sample_file, "time");
+    for (i=0; i<SAMPLE_COLS; i++)
+      fprintf(sample_file, ",%s", sample_columns[i]);
+    fprintf(sample_file, "\n");
+  }
+  else {
+    fwrite("SMPL", 1, 4, sample_file);
+    n = SAMPLE_COLS + 1;
+    fwrite(&n, sizeof(n), 1, sample_file);
+    fwrite("dtime", 1, 6, sample_file);
+    for (i=0; i<SAMPLE_COLS; i++) {
+      putc('i', sample_file);
+      fwrite(sample_columns[i], 1, strlen(sample_columns[i]) + 1, sample_file);
+    }
+  }
+  sample_rows = 0;
+  sample_next = (floor(time / sample_interval) + 1) * sample_interval;
+}
+
+static void flush_samples(void)
+{
+  int i;
+
+  if (sample_rows == 0)
+    return;
+  fwrite(&sample_rows, sizeof(sample_rows), 1, sample_file);
+  fwrite(sample_time, sizeof(double), sample_rows, sample_file);
+  for (i=0; i<SAMPLE_COLS; i++)
+    fwrite(sample_values[i], sizeof(int), sample_rows, sample_file);
+  sample_rows = 0;
+}
+
+/* take every sample due before current, the event about to be simulated */
+void sample_check(struct event *current)
+{
+  int row[SAMPLE_COLS];
+  int i;
+
+  while (sample_file != NULL && current->evtime >= sample_next) {
+    row[0] = ninflight + (current->evtype == FROM_LAYER3);
+    row[1] = proto->window(protostate);
+    row[2] = accepted_count;
+    row[3] = messages_delivered;
+    row[4] = packets_resent;
+    row[5] = nlost;
+    row[6] = ncorrupt;
+    row[7] = nevlist + 1;
+    row[8] = link_waiting(A, sample_next);
+    row[9] = link_waiting(B, sample_next);
+    if (sample_csv()) {
+      fprintf(sample_file, "%f", sample_next);
+      for (i=0; i<SAMPLE_COLS; i++)
+        fprintf(sample_file, ",%d", row[i]);
+      fprintf(sample_file, "\n");
+    }
+    else {
+      sample_time[sample_rows] = sample_next;
+      for (i=0; i<SAMPLE_COLS; i++)
+        sample_values[i][sample_rows] = row[i];
+      if (++sample_rows == SAMPLE_BLOCK)
+        flush_samples();
+    }
+    sample_next += sample_interval;
+  }
+}
+
+void close_sampler(void)
+{
+  if (sample_file == NULL)
+    return;
+  if (!sample_csv())
+    flush_samples();
+  if (fclose(sample_file) != 0)
+    printf("unable to write sample file %s\n", sample_name);
+  sample_file = NULL;
+}
+
+/********************* APPLICATION CONSUMER *******************/
+/* With --consumer N, B's in-order messages also go to an application */
+/* thread through a lock-free ring of N slots, see consumer.c.  Each  */
+/* tolayer5_batch call hands over its run of messages at once.        */
+/* layer5_space is the backpressure signal: the protocol takes and    */
+/* advertises no more than the ring has room for, so the ring should  */
+/* never be found full.  The consumer's pace is the host's, so runs   */
+/* with a consumer are not reproducible.                              */
+/*****************************************************/
+
+static int consumer_slots = 0;    /* --consumer, 0 leaves the consumer off */
+int delivery_batches;             /* tolayer5_batch calls with a consumer */
+int delivery_batch_max;           /* most messages in one of them */
+int consumer_lag_max;             /* most messages waiting in the ring at a batch */
+int consumer_waits;               /* batches that found the ring full */
+double consumer_lag;              /* sum over batches of the messages waiting */
+
+/* free ring slots, in messages */
+int layer5_space(int AorB)
+{
+  if (consumer_slots == 0 || AorB != B)
+    return INT_MAX;
+  consumer_yield();
+  return consumer_slots - consumer_backlog();
+}
+
+/********************* CHECKPOINTS *******************/
+/* A snapshot holds everything a run needs to carry on: parameters, */
+/* clock, counters, estimates, pending events and timers with their */
+/* packets, and the protocol's own state.  rand() state can't be    */
+/* saved portably, so the seed and the number of draws made since   */
+/* are kept and the generator is wound forward on restore.  Files   */
+/* (arrival trace, channel recordings, cwnd log) come from the      */
+/* restoring run's command line; the snapshot keeps only positions. */
+/* The format is native binary, readable by the same build only.    */
+/* Variants fork the running simulation, copy on write, and change  */
+/* some parameters in each child.                                   */
+/*****************************************************/
+
+#define SNAPSHOT_VERSION 9   /* bump with every change to the layout, in the same change */
+#define MAXVARIANTS 16
+#define NAMELEN 16
+
+static double checkpoint_at = -1.0;    /* --checkpoint-at T FILE */
+static char *checkpoint_name = NULL;
+static char *restore_name = NULL;      /* --restore */
+static double fork_at = -1.0;          /* --fork-at: fan out the variants here, -1 once done */
+static char *variants[MAXVARIANTS];    /* --variant, one child each */
+static int nvariants;
+static pid_t variant_pids[MAXVARIANTS];
+static FILE *variant_out[MAXVARIANTS]; /* each child's output, shown after the parent's */
+static int nforked;
+static int is_variant;                 /* this process is a forked variant */
+
+static int *snapshot_ints[] = {
+  &nsim, &nsimmax, &corruptdirection, &TRACE,
+  &congestion_control, &fec_group, &aggregate,
+  &window_full, &total_ACKs_received, &packets_resent, &new_ACKs, &packets_received,
+  &fec_parity_sent, &fec_recovered, &aggregate_packets, &aggregate_messages, &paced_packets, &pacing,
+  &packets_lost, &packets_corrupt, &packets_sent, &packets_timeout, &messages_delivered,
+  &ntolayer3, &nlost, &ncorrupt, &replay_wraps[A], &replay_wraps[B],
+  &converged, &batch_number, &batch_delivered, &batch_sent, &batch_resent,
+  &batch_ndelays, &ndelays, &link_queue,
+  &gilbert, &ge_bad[A], &ge_bad[B], &reordered[A], &reordered[B],
+  &delivery_batches, &delivery_batch_max, &consumer_lag_max, &consumer_waits,
+  &damaged_messages, NULL
+};
+static float *snapshot_floats[] = {
+  &time, &lossprob, &corruptprob, &lambda, &lastarrival[A], &lastarrival[B], NULL
+};
+static double *snapshot_doubles[] = {
+  &onoff_on, &onoff_off, &onoff_end, &precision, &batch_length,
+  &batch_end, &batch_delay, &total_delay,
+  &link_bandwidth, &link_propagation, &red_min, &red_max, &red_pmax,
+  &ge_gb, &ge_bg, &ge_lossgood, &ge_lossbad, &ber, &reorder_prob, &reorder_bound,
+  &consumer_lag, NULL
+};
+
+void snapshot_put(FILE *f, void *p, size_t n)
+{
+  if (fwrite(p, 1, n, f) != n) {
+    printf("unable to write snapshot\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void snapshot_get(FILE *f, void *p, size_t n)
+{
+  if (fread(p, 1, n, f) != n) {
+    printf("snapshot is truncated\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void put_name(FILE *f, char *name)
+{
+  char buf[NAMELEN];
+
+  memset(buf, 0, sizeof(buf));
+  strncpy(buf, name, NAMELEN-1);
+  snapshot_put(f, buf, sizeof(buf));
+}
+
+static void put_event(FILE *f, struct event *p)
+{
+  snapshot_put(f, &p->evtime, sizeof(p->evtime));
+  snapshot_put(f, &p->evtype, sizeof(p->evtype));
+  snapshot_put(f, &p->eventity, sizeof(p->eventity));
+  if (p->evtype == FROM_LAYER3)
+    snapshot_put(f, p->pktptr, sizeof(struct pkt));
+  if (p->evtype == TIMER_INTERRUPT)
+    snapshot_put(f, &p->timerid, sizeof(p->timerid));
+}
+
+static long file_position(FILE *f)
+{
+  return f != NULL ? ftell(f) : -1L;
+}
+
+/* save the run as it stands before current, the event just taken off */
+/* the lists, so that current is the first event simulated on restore */
+void write_snapshot(char *name, struct event *current)
 {
-  double mmm = RAND_MAX;     /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
-  double x;                   
-  x = rand()/mmm;            /* x should be uniform in [0,1] */
-  if (TRACE > 3)
-    printf("RANDOM NUMBER GENERAION CALLED: %f\n", x);
-  return(x);
-}  
+  FILE *f;
+  struct event *q;
+  long pos;
+  int i, n;
 
-/********************* EVENT HANDLINE ROUTINES *******/
-/*  The next set of routines handle the event list   */
-/*****************************************************/
+  f = fopen(name, "wb");
+  if (f == NULL) {
+    printf("unable to open snapshot %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+  snapshot_put(f, "SNAP", 4);
+  n = SNAPSHOT_VERSION;
+  snapshot_put(f, &n, sizeof(n));
+  n = sizeof(struct pkt);
+  snapshot_put(f, &n, sizeof(n));
+  put_name(f, proto->name);
+  put_name(f, arrival_kind);
 
-void insertevent(struct event *p)
+  for (i=0; snapshot_ints[i] != NULL; i++)
+    snapshot_put(f, snapshot_ints[i], sizeof(int));
+  for (i=0; snapshot_floats[i] != NULL; i++)
+    snapshot_put(f, snapshot_floats[i], sizeof(float));
+  for (i=0; snapshot_doubles[i] != NULL; i++)
+    snapshot_put(f, snapshot_doubles[i], sizeof(double));
+  snapshot_put(f, &seed, sizeof(seed));
+  snapshot_put(f, &rng_draws, sizeof(rng_draws));
+  snapshot_put(f, estimates, sizeof(estimates));
+  snapshot_put(f, links, sizeof(links));
+  snapshot_put(f, bursts, sizeof(bursts));
+  snapshot_put(f, &accepted_count, sizeof(accepted_count));
+  for (i=0; i<accepted_count; i++)
+    snapshot_put(f, &accepted[(accepted_head + i) % accepted_size], sizeof(struct accepted));
+
+  pos = file_position(trace_file);
+  snapshot_put(f, &pos, sizeof(pos));
+  for (i = A; i <= B; i++) {
+    pos = file_position(replay_file[i]);
+    snapshot_put(f, &pos, sizeof(pos));
+  }
+
+  /* events in the order they will be taken: current, then evlist */
+  n = 1;
+  for (q = evlist; q != NULL; q = q->next)
+    n++;
+  snapshot_put(f, &n, sizeof(n));
+  put_event(f, current);
+  for (q = evlist; q != NULL; q = q->next)
+    put_event(f, q);
+
+  proto->save(protostate, f);
+  if (fclose(f) != 0) {
+    printf("unable to write snapshot %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+  if (TRACE>1)
+    trace("          CHECKPOINT: state at time %f written to %s\n", time, name);
+}
+
+/* set up a run from a snapshot instead of from init() and init_run() */
+void read_snapshot(char *name)
 {
-  struct event *q,*qold;
+  FILE *f;
+  struct event *p, *last;
+  char magic[4], protoname[NAMELEN], arrivalname[NAMELEN];
+  long tracepos, replaypos[2];
+  double onoff_saved;
+  unsigned long draws;
+  int i, n, version, pktsize;
 
-  if (TRACE>2) {
-    printf("            INSERTEVENT: time is %f\n",time);
-    printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
+  f = fopen(name, "rb");
+  if (f == NULL) {
+    printf("unable to open snapshot %s\n", name);
+    exit(EXIT_FAILURE);
   }
-  q = evlist;     /* q points to front of list in which p struct inserted */
-  if (q==NULL) {   /* list is empty */
-    evlist=p;
-    p->next=NULL;
-    p->prev=NULL;
+  snapshot_get(f, magic, 4);
+  snapshot_get(f, &version, sizeof(version));
+  snapshot_get(f, &pktsize, sizeof(pktsize));
+  if (memcmp(magic, "SNAP", 4) != 0 || version != SNAPSHOT_VERSION
+      || pktsize != sizeof(struct pkt)) {
+    printf("%s is not a snapshot from this emulator\n", name);
+    exit(EXIT_FAILURE);
   }
-  else {
-    for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-      qold=q; 
-    if (q==NULL) {   /* end of list */
-      qold->next = p;
-      p->prev = qold;
-      p->next = NULL;
+  snapshot_get(f, protoname, NAMELEN);
+  snapshot_get(f, arrivalname, NAMELEN);
+  protoname[NAMELEN-1] = arrivalname[NAMELEN-1] = '\0';
+  for (i=0; protocols[i] != NULL; i++)
+    if (strcmp(protocols[i]->name, protoname) == 0)
+      break;
+  if (protocols[i] == NULL) {
+    printf("snapshot %s is of unknown protocol %s\n", name, protoname);
+    exit(EXIT_FAILURE);
+  }
+  proto = protocols[i];
+  for (i=0; arrivalgens[i].name != NULL; i++)
+    if (strcmp(arrivalgens[i].name, arrivalname) == 0)
+      arrival_kind = arrivalgens[i].name;
+
+  for (i=0; snapshot_ints[i] != NULL; i++)
+    snapshot_get(f, snapshot_ints[i], sizeof(int));
+  for (i=0; snapshot_floats[i] != NULL; i++)
+    snapshot_get(f, snapshot_floats[i], sizeof(float));
+  for (i=0; snapshot_doubles[i] != NULL; i++)
+    snapshot_get(f, snapshot_doubles[i], sizeof(double));
+  snapshot_get(f, &seed, sizeof(seed));
+  snapshot_get(f, &draws, sizeof(draws));
+  snapshot_get(f, estimates, sizeof(estimates));
+  snapshot_get(f, links, sizeof(links));
+  snapshot_get(f, bursts, sizeof(bursts));
+  snapshot_get(f, &n, sizeof(n));
+  accepted_size = n > 64 ? n : 64;
+  accepted = malloc(accepted_size * sizeof(struct accepted));
+  if (accepted == NULL) {
+    printf("memory allocation for message times failed.");
+    exit(EXIT_FAILURE);
+  }
+  accepted_head = 0;
+  for (accepted_count=0; accepted_count<n; accepted_count++)
+    snapshot_get(f, &accepted[accepted_count], sizeof(struct accepted));
+
+  snapshot_get(f, &tracepos, sizeof(tracepos));
+  snapshot_get(f, replaypos, sizeof(replaypos));
+  onoff_saved = onoff_end;
+  init_arrivals();
+  onoff_end = onoff_saved;
+  if (trace_file != NULL && tracepos >= 0)
+    fseek(trace_file, tracepos, SEEK_SET);
+  init_channel();
+  for (i = A; i <= B; i++)
+    if (replay_file[i] != NULL && replaypos[i] >= 0)
+      fseek(replay_file[i], replaypos[i], SEEK_SET);
+
+  snapshot_get(f, &n, sizeof(n));
+  last = NULL;
+  for (; n > 0; n--) {
+    p = malloc(sizeof(struct event));
+    if (p == NULL) {
+      printf("memory allocation for event failed.");
+      exit(EXIT_FAILURE);
     }
-    else if (q==evlist) { /* front of list */
-      p->next=evlist;
-      p->prev=NULL;
-      p->next->prev=p;
-      evlist = p;
+    snapshot_get(f, &p->evtime, sizeof(p->evtime));
+    snapshot_get(f, &p->evtype, sizeof(p->evtype));
+    snapshot_get(f, &p->eventity, sizeof(p->eventity));
+    p->pktptr = NULL;
+    if (p->evtype == FROM_LAYER3) {
+      p->pktptr = pkt_alloc();
+      snapshot_get(f, p->pktptr, sizeof(struct pkt));
     }
-    else {     /* middle of list */
-      p->next=q;
-      p->prev=q->prev;
-      q->prev->next=p;
-      q->prev=p;
+    if (p->evtype == TIMER_INTERRUPT) {
+      snapshot_get(f, &p->timerid, sizeof(p->timerid));
+      if (p->timerid < 0 || p->timerid >= NTIMERS) {
+        printf("snapshot %s is corrupt\n", name);
+        exit(EXIT_FAILURE);
+      }
+      timers[p->eventity][p->timerid] = p;
     }
+    /* saved in list order, so append; insertevent would reverse ties */
+    nevlist++;
+    if (p->evtype == FROM_LAYER3)
+      ninflight++;
+    p->next = NULL;
+    p->prev = last;
+    if (last != NULL)
+      last->next = p;
+    else
+      evlist = p;
+    last = p;
   }
+
+  protostate = proto->create();
+  proto->A_init(protostate);
+  proto->B_init(protostate);
+  proto->restore(protostate, f);
+  fclose(f);
+  init_sampler();
+
+  srand(seed);
+  for (rng_draws=0; rng_draws<draws; rng_draws++)
+    rand();
+  printf("-----  Restored %s at time %f -------- \n\n", name, time);
 }
 
+#define VARIANT_PARSE 0   /* only check that the variant is well formed */
+#define VARIANT_CHECK 1   /* and that the protocol implements it */
+#define VARIANT_APPLY 2   /* and change the parameters */
 
-void generate_next_arrival(void)
+/* parse a variant, name=value[,name=value...], and as far as mode    */
+/* says check and apply it; returns 0 if the variant fails the check. */
+/* Unless it sets a new seed, a variant keeps drawing from the same   */
+/* random number stream as the run it forked from.                    */
+int apply_variant(char *spec, int mode)
 {
-  double x;
-  struct event *evptr;
+  char buf[256], *item, *eq;
+  double v;
 
-  if (TRACE>2)
-    printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
- 
-  x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
-  /* having mean of lambda        */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
+  if (strlen(spec) >= sizeof(buf))
+    return 0;
+  strcpy(buf, spec);
+  for (item = strtok(buf, ","); item != NULL; item = strtok(NULL, ",")) {
+    eq = strchr(item, '=');
+    if (eq == NULL)
+      return 0;
+    *eq = '\0';
+    v = atof(eq + 1);
+    if (strcmp(item, "loss") == 0) {
+      if (mode == VARIANT_APPLY)
+        lossprob = v;
+    }
+    else if (strcmp(item, "corrupt") == 0) {
+      if (mode == VARIANT_APPLY)
+        corruptprob = v;
+    }
+    else if (strcmp(item, "direction") == 0) {
+      if (mode == VARIANT_APPLY)
+        corruptdirection = (int)v;
+    }
+    else if (strcmp(item, "lambda") == 0) {
+      if (mode == VARIANT_APPLY)
+        lambda = v;
+    }
+    else if (strcmp(item, "cc") == 0) {
+      if (mode != VARIANT_PARSE && !(proto->features & PROTO_CC))
+        return 0;
+      if (mode == VARIANT_APPLY)
+        congestion_control = (int)v;
+    }
+    else if (strcmp(item, "seed") == 0) {
+      if (mode == VARIANT_APPLY) {
+        seed = (unsigned)v;
+        srand(seed);
+        rng_draws = 0;
+      }
+    }
+    else
+      return 0;
+  }
+  return 1;
+}
+
+/* A forked child shares its parent's open files, offsets and all, so */
+/* it reads on from the same place through a file of its own.  The   */
+/* old stream is left open: closing it would move the shared offset. */
+static FILE *reopen_at(FILE *f, char *name)
+{
+  FILE *g;
+
+  if (f == NULL)
+    return NULL;
+  g = fopen(name, "rb");
+  if (g == NULL || fseek(g, ftell(f), SEEK_SET) != 0) {
+    printf("unable to reopen %s\n", name);
     exit(EXIT_FAILURE);
   }
-  evptr->evtime =  time + x;
-  evptr->evtype =  FROM_LAYER5;
-  if (BIDIRECTIONAL && (jimsrand()>0.5) )
-    evptr->eventity = B;
-  else
-    evptr->eventity = A;
-  insertevent(evptr);
-} 
+  return g;
+}
+
+/* fork one child per variant; each child returns here as that variant */
+void fork_variants(void)
+{
+  int v;
+
+  fflush(stdout);   /* or every child prints it again */
+  consumer_drain();  /* the children start their own consumer on an empty ring */
+  for (v=0; v<nvariants; v++) {
+    variant_out[v] = tmpfile();
+    if (variant_out[v] == NULL || (variant_pids[v] = fork()) < 0) {
+      perror("fork_variants");
+      exit(EXIT_FAILURE);
+    }
+    if (variant_pids[v] == 0) {
+      if (dup2(fileno(variant_out[v]), STDOUT_FILENO) < 0)
+        _exit(EXIT_FAILURE);
+      trace_file = reopen_at(trace_file, trace_name);
+      replay_file[A] = reopen_at(replay_file[A], replay_name);
+      replay_file[B] = reopen_at(replay_file[B], replay_name);
+      apply_variant(variants[v], VARIANT_APPLY);
+      nforked = 0;
+      is_variant = 1;
+      consumer_start(consumer_slots);
+      return;
+    }
+  }
+  nforked = nvariants;
+}
+
+/* wait for the variants and print their output after the parent's */
+void collect_variants(void)
+{
+  int v, c;
+
+  if (is_variant) {   /* leave the shared input streams alone, see reopen_at */
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+  }
+  for (v=0; v<nforked; v++) {
+    waitpid(variant_pids[v], NULL, 0);
+    printf("\n-----  Variant %s -------- \n", variants[v]);
+    rewind(variant_out[v]);
+    while ((c = getc(variant_out[v])) != EOF)
+      putchar(c);
+    fclose(variant_out[v]);
+  }
+}
 
 void printevlist(void)
 {
@@ -187,9 +1631,6 @@ void printevlist(void)
 
 void init(void)                         /* initialize the simulator */
 {
-  float sum, avg;
-  int i;
-
   printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
   printf("Enter the number of messages to simulate: ");
   scanf("%d",&nsimmax);
@@ -205,9 +1646,15 @@ void init(void)                         /* initialize the simulator */
   scanf("%f",&lambda);
   printf("Enter TRACE:");
   scanf("%d",&TRACE);
+}
 
+void init_run(unsigned runseed)         /* start one run of the simulation */
+{
+  float sum, avg;
+  int i;
 
-  srand(9999);              /* init random number generator */
+  srand(runseed);           /* init random number generator */
+  rng_draws = 0;
   sum = 0.0;                /* test random number generator for students */
   for (i=0; i<1000; i++)
     sum+=jimsrand();    /* jimsrand() should be uniform in [0,1] */
@@ -225,6 +1672,11 @@ void init(void)                         /* initialize the simulator */
   packets_resent = 0;
   new_ACKs = 0;
   packets_received = 0;
+  fec_parity_sent = 0;
+  fec_recovered = 0;
+  aggregate_packets = 0;
+  aggregate_messages = 0;
+  paced_packets = 0;
   packets_lost = 0;  
   packets_corrupt = 0;
   packets_sent = 0;
@@ -236,58 +1688,61 @@ void init(void)                         /* initialize the simulator */
   ncorrupt = 0;
 
   time=0.0;                    /* initialize time to 0.0 */
+  init_arrivals();
+  init_channel();
+  init_link();
+  init_statistics();
   generate_next_arrival();     /* initialize event list */
+
+  protostate = proto->create();
+  proto->A_init(protostate);
+  proto->B_init(protostate);
+  init_sampler();
 }
 
 /********************** Student-callable ROUTINES ***********************/
 
 /* called by students routine to cancel a previously-started timer */
-void stoptimer(int AorB)
+void stoptimer_id(int AorB, int id)
 /* A or B is trying to stop timer */
 {
   struct event *q;
 
+  PROF_ENTER();
   if (TRACE>1)
-    printf("          STOP TIMER: stopping timer at %f\n",time);
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      /* remove this event */
-      if (q->next==NULL && q->prev==NULL)
-        evlist=NULL;         /* remove first and only event on list */
-      else if (q->next==NULL) /* end of list - there is one in front */
-        q->prev->next = NULL;
-      else if (q==evlist) { /* front of list - there must be event after */
-        q->next->prev=NULL;
-        evlist = q->next;
-      }
-      else {     /* middle of list */
-        q->next->prev = q->prev;
-        q->prev->next =  q->next;
-      }
-      free(q);
-      return;
-    }
-  printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    trace("          STOP TIMER: stopping timer at %f\n",time);
+  q = timers[AorB][id];
+  if (q == NULL) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    PROF_LEAVE(PROF_STOPTIMER);
+    return;
+  }
+  removeevent(q);
+  timers[AorB][id] = NULL;
+  free(q);
+  PROF_LEAVE(PROF_STOPTIMER);
+}
+
+void stoptimer(int AorB)
+{
+  stoptimer_id(AorB, 0);
 }
 
 
-void starttimer(int AorB, double increment)
+void starttimer_id(int AorB, int id, double increment)
 /* A or B is trying to start timer */
 {
-
-  struct event *q;
   struct event *evptr;
 
+  PROF_ENTER();
   if (TRACE>1)
-    printf("          START TIMER: starting timer at %f\n",time);
+    trace("          START TIMER: starting timer at %f\n",time);
   /* be nice: check to see if timer is already started, if so, then  warn */
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next)  
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      printf("Warning: attempt to start a timer that is already started\n");
-      return;
-    }
+  if (timers[AorB][id] != NULL) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    PROF_LEAVE(PROF_STARTTIMER);
+    return;
+  }
  
   /* create future event for when timer goes off */
   evptr = malloc(sizeof(struct event));
@@ -297,50 +1752,123 @@ void starttimer(int AorB, double increment)
   }
   evptr->evtime =  time + increment;
   evptr->evtype =  TIMER_INTERRUPT;
-   
- 
   evptr->eventity = AorB;
+  evptr->pktptr = NULL;
+  evptr->timerid = id;
+  if (TRACE>2)
+    trace("            STARTTIMER: timer will go off at %f\n",evptr->evtime);
   insertevent(evptr);
+  timers[AorB][id] = evptr;
+  PROF_LEAVE(PROF_STARTTIMER);
 } 
 
+void starttimer(int AorB, double increment)
+{
+  starttimer_id(AorB, 0, increment);
+}
+
+
+/************************** PACKET POOL ***************/
+/* Packets handed between the protocol and the emulator live in   */
+/* reference-counted buffers recycled through a free list.  A     */
+/* packet is written once by its sender and read in place by      */
+/* everyone else; the only copy made is when the channel corrupts */
+/* a packet that someone else still holds.  Build with -DNOPOOL   */
+/* to free each buffer at its last release instead, so a memory   */
+/* checker catches a packet used after it.                        */
+/*****************************************************/
+
+struct pktbuf {
+  struct pkt pkt;         /* must be first: a struct pkt * is a struct pktbuf * */
+  int refcount;
+  struct pktbuf *next;    /* free list link */
+};
+
+static struct pktbuf *pktfree = NULL;
+
+struct pkt *pkt_alloc(void)
+{
+  struct pktbuf *b;
+
+  if (pktfree != NULL) {
+    b = pktfree;
+    pktfree = b->next;
+  }
+  else {
+    b = malloc(sizeof(struct pktbuf));
+    if (b == 0) {
+      printf("memory allocation for packet failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  b->refcount = 1;
+  return &b->pkt;
+}
+
+void pkt_hold(struct pkt *p)
+{
+  ((struct pktbuf *)p)->refcount++;
+}
+
+void pkt_release(struct pkt *p)
+{
+  struct pktbuf *b = (struct pktbuf *)p;
+
+  if (--b->refcount == 0) {
+#ifdef NOPOOL
+    free(b);
+#else
+    b->next = pktfree;
+    pktfree = b;
+#endif
+  }
+}
 
 /************************** TOLAYER3 ***************/
-void tolayer3(int AorB, struct pkt packet)
-/* A or B is sending to network  */
+void tolayer3_ref(int AorB, struct pkt *packet)
+/* A or B is sending to network; the caller keeps its own reference */
 {
   struct pkt *mypktptr;
-  struct event *evptr,*q;
-  float lastime, x;
+  struct event *evptr;
+  struct fate fate;
+  float lastime;
+  double arrival = 0.0;
   int i;
 
+  PROF_ENTER();
   ntolayer3++;
+  if (AorB == A)
+    packets_sent++;
+  channel_fate(AorB, HEADERBITS + 8 * (packet->length < PAYLOADSIZE ? packet->length : PAYLOADSIZE),
+               &fate);
+  if (fate.late > 0)
+    reordered[AorB]++;
+
+  /* simulate the queue of a bandwidth-limited link */
+  if (link_bandwidth > 0.0
+      && (arrival = link_send(AorB, LINK_HEADER + packet->length)) < 0.0) {
+    nlost++;
+    if (TRACE>0)
+      trace("          TOLAYER3: packet dropped by a full queue\n");
+    PROF_LEAVE(PROF_TOLAYER3);
+    return;
+  }
 
   /* simulate losses: */
-  if (jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+  if (fate.kind == FATE_LOST) {
     nlost++;
     if (TRACE>0)    
-      printf("          TOLAYER3: packet being lost\n");
+      trace("          TOLAYER3: packet being lost\n");
+    PROF_LEAVE(PROF_TOLAYER3);
     return;
   }  
 
-  /* make a copy of the packet student just gave me since he/she may decide */
-  /* to do something with the packet after we return back to him/her */ 
-  mypktptr = malloc(sizeof(struct pkt));
-  if (mypktptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  mypktptr->seqnum = packet.seqnum;
-  mypktptr->acknum = packet.acknum;
-  mypktptr->checksum = packet.checksum;
-  for (i=0; i<20; i++)
-    mypktptr->payload[i] = packet.payload[i];
   if (TRACE>2)  {
-    printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
-           mypktptr->acknum,  mypktptr->checksum);
-    for (i=0; i<20; i++)
-      printf("%c",mypktptr->payload[i]);
-    printf("\n");
+    trace("          TOLAYER3: seq: %d, ack %d, check: %d ", packet->seqnum,
+           packet->acknum,  packet->checksum);
+    for (i=0; i<packet->length && i<PAYLOADSIZE; i++)
+      trace("%c",packet->payload[i]);
+    trace("\n");
   }
 
   /* create future event for arrival of packet at the other side */
@@ -351,132 +1879,395 @@ void tolayer3(int AorB, struct pkt packet)
   }
   evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
   evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
-  evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
   /* finally, compute the arrival time of packet at the other end.
      medium can not reorder, so make sure packet arrives between 1 and 10
      time units after the latest arrival time of packets
-     currently in the medium on their way to the destination */
-  lastime = time;
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) ) 
-      lastime = q->evtime;
-  evptr->evtime =  lastime + 1 + 9*jimsrand();
+     currently in the medium on their way to the destination,
+     unless the channel holds it back to be overtaken */
+  if (link_bandwidth > 0.0)
+    evptr->evtime = arrival;   /* the link decides, see link_send */
+  else {
+    lastime = time;
+    if (lastarrival[AorB] > lastime)
+      lastime = lastarrival[AorB];
+    evptr->evtime =  lastime + 1 + fate.delay;
+    if (fate.late == 0)
+      lastarrival[AorB] = evptr->evtime;
+  }
+  evptr->evtime += fate.late;
  
 
 
-  /* simulate corruption: */
-  if ((jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+  /* simulate corruption, on a private copy since the sender still holds the packet */
+  if (fate.kind != FATE_DELIVERED) {
     ncorrupt++;
-    if ( (x = jimsrand()) < .75)
+    mypktptr = pkt_alloc();
+    *mypktptr = *packet;
+    if (fate.kind == FATE_BITS)
+      flip_bits(mypktptr, &fate);
+    else if (fate.kind == FATE_PAYLOAD && packet->length == 0)
+      mypktptr->window = 999999;  /* no payload to corrupt, hit the header instead */
+    else if (fate.kind == FATE_PAYLOAD)
       mypktptr->payload[0]='Z';   /* corrupt payload */
-    else if (x < .875)
+    else if (fate.kind == FATE_SEQNUM)
       mypktptr->seqnum = 999999;
     else
       mypktptr->acknum = 999999;
     if (TRACE>0)    
-      printf("          TOLAYER3: packet being corrupted\n");
+      trace("          TOLAYER3: packet being corrupted\n");
   }  
+  else {
+    mypktptr = packet;
+    pkt_hold(mypktptr);
+  }
+  evptr->pktptr = mypktptr;       /* the event holds its own reference */
 
   if (TRACE>2)  
-    printf("          TOLAYER3: scheduling arrival on other side\n");
+    trace("          TOLAYER3: scheduling arrival on other side\n");
   insertevent(evptr);
+  PROF_LEAVE(PROF_TOLAYER3);
 } 
 
-void tolayer5(int AorB, char datasent[20])
+void tolayer3(int AorB, struct pkt packet)
+/* A or B is sending a packet by value; the emulator keeps a pooled copy */
+{
+  struct pkt *mypktptr;
+
+  mypktptr = pkt_alloc();
+  *mypktptr = packet;
+  tolayer3_ref(AorB, mypktptr);
+  pkt_release(mypktptr);
+}
+
+static void deliver(int AorB, char datasent[MSGSIZE])
 {
   int i;  
+
   if (TRACE>2) {
-    printf("          TOLAYER5: data received by application at ");
+    trace("          TOLAYER5: data received by application at ");
     if (AorB == A) 
-      printf("A: ");
+      trace("A: ");
     else
-      printf("B: ");
-    for (i=0; i<20; i++)  
-      printf("%c",datasent[i]);
-    printf("\n");
+      trace("B: ");
+    for (i=0; i<MSGSIZE; i++)  
+      trace("%c",datasent[i]);
+    trace("\n");
   }
   messages_delivered++;
+  if (AorB == B)
+    message_arrived(datasent);
+}
+
+void tolayer5(int AorB, char datasent[MSGSIZE])
+{
+  PROF_ENTER();
+  deliver(AorB, datasent);
+  PROF_LEAVE(PROF_TOLAYER5);
+}
+
+void tolayer5_batch(int AorB, char *data, int nmsgs)
+{
+  int i, lag;
+
+  PROF_ENTER();
+  for (i=0; i<nmsgs; i++)
+    deliver(AorB, data + i * MSGSIZE);
+  if (consumer_slots > 0 && AorB == B && nmsgs > 0) {
+    lag = consumer_backlog();
+    delivery_batches++;
+    if (nmsgs > delivery_batch_max)
+      delivery_batch_max = nmsgs;
+    consumer_lag += lag;
+    if (lag > consumer_lag_max)
+      consumer_lag_max = lag;
+    if (consumer_put(data, nmsgs))
+      consumer_waits++;
+  }
+  PROF_LEAVE(PROF_TOLAYER5);
+}
+
+/************************** COMMAND LINE ***************/
+void usage(char *progname)
+{
+  printf("usage: %s [options]\n", progname);
+  printf("  --protocol NAME   protocol engine to simulate: sr (default) or gbn\n");
+  printf("  --cc              enable AIMD congestion control at A\n");
+  printf("  --cwnd-log FILE   write A's congestion window time series to FILE\n");
+  printf("  --fec K           send an XOR parity packet after every K data packets\n");
+  printf("  --pacing          space A's new packets at its estimate of the delivery rate\n");
+  printf("  --aggregate N     pack up to N (<= %d) messages into one packet\n", MAXAGGREGATE);
+  printf("  --arrivals KIND   layer 5 arrivals: uniform (default), poisson, onoff or trace\n");
+  printf("  --on-time T       mean length of an onoff burst (default %.0f)\n", onoff_on);
+  printf("  --off-time T      mean gap between onoff bursts (default %.0f)\n", onoff_off);
+  printf("  --trace-file FILE arrival times for --arrivals trace, one per line\n");
+  printf("  --record-channel FILE  record each packet's loss/corruption/delay to FILE\n");
+  printf("  --replay-channel FILE  replay a channel recording instead of drawing at random\n");
+  printf("  --gilbert PGB,PBG,LG,LB  Gilbert-Elliott loss: chance per packet of going bad\n");
+  printf("                    and back to good, and of a loss when good and when bad\n");
+  printf("  --ber RATE        flip each header and payload bit with chance RATE\n");
+  printf("  --reorder P,D     hold a packet back by up to D time units with chance P\n");
+  printf("  --bandwidth B     model each direction as a link of B bytes per time unit\n");
+  printf("  --propagation D   the links' propagation delay (default %g)\n", link_propagation);
+  printf("  --queue N         packets a link queue holds before dropping (default %d)\n", link_queue);
+  printf("  --red MIN,MAX,P   RED early drops between MIN and MAX average queue, up to P\n");
+  printf("  --consumer N      deliver B's messages in batches to an application thread\n");
+  printf("                    through a ring of N (a power of 2) messages\n");
+  printf("  --batch T         estimate goodput, delay and retransmissions over batches of T\n");
+  printf("  --precision P     stop once every 95%% CI is within P times its mean\n");
+  printf("  --seed N          random number seed (default %u)\n", seed);
+  printf("  --seeds R         make R runs with seeds N..N+R-1 side by side, report mean +/- CI\n");
+  printf("  --sample T FILE   write a row of the simulation state to FILE every T time units\n");
+  printf("  --sample-format F columns (default, compact binary) or csv\n");
+  printf("  --checkpoint-at T FILE  save the whole simulation state to FILE at time T\n");
+  printf("  --restore FILE    carry on from a saved state instead of reading parameters\n");
+  printf("  --fork-at T       fork the --variant runs at time T (default: at the start)\n");
+  printf("  --variant SPEC    also run with SPEC = name=value,... changed, up to %d times;\n", MAXVARIANTS);
+  printf("                    names: loss, corrupt, direction, lambda, cc, seed\n");
+  exit(EXIT_FAILURE);
+}
+
+void parse_args(int argc, char *argv[])
+{
+  int i, p;
+
+  for (i=1; i<argc; i++) {
+    if (strcmp(argv[i], "--protocol") == 0 && i+1 < argc) {
+      i++;
+      for (p=0; protocols[p] != NULL; p++)
+        if (strcmp(protocols[p]->name, argv[i]) == 0)
+          break;
+      if (protocols[p] == NULL)
+        usage(argv[0]);
+      proto = protocols[p];
+    }
+    else if (strcmp(argv[i], "--cc") == 0)
+      congestion_control = 1;
+    else if (strcmp(argv[i], "--cwnd-log") == 0 && i+1 < argc)
+      cwnd_logfile = argv[++i];
+    else if (strcmp(argv[i], "--fec") == 0 && i+1 < argc)
+      fec_group = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--consumer") == 0 && i+1 < argc) {
+      consumer_slots = atoi(argv[++i]);
+      if (consumer_slots <= 0 || (consumer_slots & (consumer_slots - 1)) != 0) {
+        printf("the consumer ring must hold a power of 2 messages\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "--pacing") == 0)
+      pacing = 1;
+    else if (strcmp(argv[i], "--aggregate") == 0 && i+1 < argc)
+      aggregate = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--arrivals") == 0 && i+1 < argc)
+      arrival_kind = argv[++i];
+    else if (strcmp(argv[i], "--on-time") == 0 && i+1 < argc)
+      onoff_on = atof(argv[++i]);
+    else if (strcmp(argv[i], "--off-time") == 0 && i+1 < argc)
+      onoff_off = atof(argv[++i]);
+    else if (strcmp(argv[i], "--trace-file") == 0 && i+1 < argc)
+      trace_name = argv[++i];
+    else if (strcmp(argv[i], "--record-channel") == 0 && i+1 < argc)
+      record_name = argv[++i];
+    else if (strcmp(argv[i], "--replay-channel") == 0 && i+1 < argc)
+      replay_name = argv[++i];
+    else if (strcmp(argv[i], "--gilbert") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf,%lf,%lf,%lf", &ge_gb, &ge_bg, &ge_lossgood, &ge_lossbad) != 4)
+        usage(argv[0]);
+      gilbert = 1;
+    }
+    else if (strcmp(argv[i], "--ber") == 0 && i+1 < argc) {
+      ber = atof(argv[++i]);
+      if (ber < 0.0 || ber >= 1.0)
+        usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "--reorder") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf,%lf", &reorder_prob, &reorder_bound) != 2 || reorder_bound < 0.0)
+        usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "--bandwidth") == 0 && i+1 < argc)
+      link_bandwidth = atof(argv[++i]);
+    else if (strcmp(argv[i], "--propagation") == 0 && i+1 < argc)
+      link_propagation = atof(argv[++i]);
+    else if (strcmp(argv[i], "--queue") == 0 && i+1 < argc)
+      link_queue = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--red") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf,%lf,%lf", &red_min, &red_max, &red_pmax) != 3
+          || red_min < 0.0 || red_max <= red_min)
+        usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "--batch") == 0 && i+1 < argc)
+      batch_length = atof(argv[++i]);
+    else if (strcmp(argv[i], "--precision") == 0 && i+1 < argc)
+      precision = atof(argv[++i]);
+    else if (strcmp(argv[i], "--seed") == 0 && i+1 < argc)
+      seed = (unsigned)strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--seeds") == 0 && i+1 < argc)
+      nseeds = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--sample") == 0 && i+2 < argc) {
+      sample_interval = atof(argv[++i]);
+      sample_name = argv[++i];
+      if (sample_interval <= 0.0)
+        usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "--sample-format") == 0 && i+1 < argc) {
+      sample_format = argv[++i];
+      if (strcmp(sample_format, "csv") != 0 && strcmp(sample_format, "columns") != 0)
+        usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "--checkpoint-at") == 0 && i+2 < argc) {
+      checkpoint_at = atof(argv[++i]);
+      checkpoint_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "--restore") == 0 && i+1 < argc)
+      restore_name = argv[++i];
+    else if (strcmp(argv[i], "--fork-at") == 0 && i+1 < argc)
+      fork_at = atof(argv[++i]);
+    else if (strcmp(argv[i], "--variant") == 0 && i+1 < argc
+             && nvariants < MAXVARIANTS && apply_variant(argv[i+1], VARIANT_PARSE))
+      variants[nvariants++] = argv[++i];
+    else
+      usage(argv[0]);
+  }
+  /* every run would write the same file */
+  if ((nseeds > 1 || nvariants > 0)
+      && (record_name != NULL || cwnd_logfile != NULL || sample_name != NULL))
+    usage(argv[0]);
+  if (nseeds > 1 && (restore_name != NULL || nvariants > 0 || checkpoint_name != NULL))
+    usage(argv[0]);
+  /* a replaying channel deals no fates of its own to record */
+  if (record_name != NULL && replay_name != NULL)
+    usage(argv[0]);
+  if (nvariants == 0)
+    fork_at = -1.0;
+  else if (fork_at < 0.0)
+    fork_at = 0.0;
+}
+
+/* refuse an option the protocol would silently ignore */
+static void need_feature(int feature, int used, char *option)
+{
+  if (used && !(proto->features & feature)) {
+    printf("protocol %s does not implement %s\n", proto->name, option);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* called once the protocol is known, after any --restore */
+void check_features(void)
+{
+  int v;
+
+  need_feature(PROTO_CC, congestion_control, "--cc");
+  need_feature(PROTO_CWNDLOG, cwnd_logfile != NULL, "--cwnd-log");
+  need_feature(PROTO_FEC, fec_group > 0, "--fec");
+  need_feature(PROTO_AGGREGATE, aggregate > 1, "--aggregate");
+  need_feature(PROTO_PACING, pacing, "--pacing");
+  /* B takes a packet only once the ring has room for all it may carry */
+  if (consumer_slots > 0 && consumer_slots < aggregate) {
+    printf("the consumer ring must hold at least %d messages for --aggregate %d\n",
+           aggregate, aggregate);
+    exit(EXIT_FAILURE);
+  }
+  for (v=0; v<nvariants; v++)
+    if (!apply_variant(variants[v], VARIANT_CHECK)) {
+      printf("protocol %s does not implement variant %s\n", proto->name, variants[v]);
+      exit(EXIT_FAILURE);
+    }
 }
 
-int main(void)
+void simulate(void)
 {
   struct event *eventptr;
   struct msg  msg2give;
-  struct pkt  pkt2give;
    
-  int i,j;
+  int i,j,dropped;
   
-  init();
-  A_init();
-  B_init();
-   
   while (1) {
-    eventptr = evlist;            /* get next event to simulate */
+    eventptr = nextevent();       /* get next event to simulate */
     if (eventptr==NULL)
-      goto terminate;
-    evlist = evlist->next;        /* remove this event from event list */
-    if (evlist!=NULL)
-      evlist->prev=NULL;
+      return;
+    if (checkpoint_name != NULL && eventptr->evtime >= checkpoint_at) {
+      write_snapshot(checkpoint_name, eventptr);
+      checkpoint_name = NULL;
+    }
+    if (fork_at >= 0.0 && eventptr->evtime >= fork_at) {
+      fork_at = -1.0;
+      fork_variants();
+    }
+    sample_check(eventptr);
+    PROF_ENTER();
     if (TRACE>=2) {
-      printf("\nEVENT time: %f,",eventptr->evtime);
-      printf("  type: %d",eventptr->evtype);
+      trace("\nEVENT time: %f,",eventptr->evtime);
+      trace("  type: %d",eventptr->evtype);
       if (eventptr->evtype==0)
-        printf(", timerinterrupt  ");
+        trace(", timerinterrupt  ");
       else if (eventptr->evtype==1)
-        printf(", fromlayer5 ");
+        trace(", fromlayer5 ");
       else
-        printf(", fromlayer3 ");
-      printf(" entity: %d\n",eventptr->eventity);
+        trace(", fromlayer3 ");
+      trace(" entity: %d\n",eventptr->eventity);
     }
     time = eventptr->evtime;        /* update time to next event time */
+    if (batch_check()) {            /* precise enough, stop here */
+      if (eventptr->evtype == FROM_LAYER3)
+        pkt_release(eventptr->pktptr);
+      free(eventptr);
+      return;
+    }
     if (eventptr->evtype == FROM_LAYER5 ) {
       if (nsim < nsimmax) {
         generate_next_arrival();   /* set up future arrival */
         /* fill in msg to give with string of same letter */    
         j = nsim % 26; 
-        for (i=0; i<20; i++)  
+        for (i=0; i<MSGSIZE; i++)  
           msg2give.data[i] = 97 + j;
         if (TRACE>2) {
-          printf("          MAINLOOP: data given to student: ");
-          for (i=0; i<20; i++) 
-            printf("%c", msg2give.data[i]);
-          printf("\n");
+          trace("          MAINLOOP: data given to student: ");
+          for (i=0; i<MSGSIZE; i++) 
+            trace("%c", msg2give.data[i]);
+          trace("\n");
         }
         nsim++;
-        if (eventptr->eventity == A) 
-          A_output(msg2give);  
+        if (eventptr->eventity == A) {
+          dropped = window_full;
+          proto->A_output(protostate, msg2give);  
+          if (window_full == dropped)
+            message_accepted(msg2give.data);
+        }
         else
-          B_output(msg2give);  
+          proto->B_output(protostate, msg2give);  
       }
       else if (TRACE > 2)
-          printf("          FROM_LAYER5: no more messages to send: \n");
+          trace("          FROM_LAYER5: no more messages to send: \n");
     }
     else if (eventptr->evtype ==  FROM_LAYER3) {
-      pkt2give.seqnum = eventptr->pktptr->seqnum;
-      pkt2give.acknum = eventptr->pktptr->acknum;
-      pkt2give.checksum = eventptr->pktptr->checksum;
-      for (i=0; i<20; i++)  
-        pkt2give.payload[i] = eventptr->pktptr->payload[i];
 	    if (eventptr->eventity ==A)      /* deliver packet by calling */
-        A_input(pkt2give);            /* appropriate entity */
+        proto->A_input(protostate, eventptr->pktptr);  /* appropriate entity, in place */
       else
-        B_input(pkt2give);
-	    free(eventptr->pktptr);          /* free the memory for packet */
+        proto->B_input(protostate, eventptr->pktptr);
+	    pkt_release(eventptr->pktptr);   /* drop the event's reference */
     }
     else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-      if (eventptr->eventity == A) 
-        A_timerinterrupt();
+      if (eventptr->timerid != 0)
+        proto->timer(protostate, eventptr->eventity, eventptr->timerid);
+      else if (eventptr->eventity == A) 
+        proto->A_timerinterrupt(protostate);
       else
-        B_timerinterrupt();
+        proto->B_timerinterrupt(protostate);
     }
     else  {
       printf("INTERNAL PANIC: unknown event type \n");
     }
+    /* an unknown type has no slot and is not counted */
+    PROF_LEAVE(eventptr->evtype < NEVTYPES ? PROF_DISPATCH(eventptr->evtype, eventptr->eventity)
+               : NPROF);
     free(eventptr);
   }
+}
+
+void report(void)
+{
+  int m, i;
 
- terminate:
   printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",time,nsim);
   printf("number of messages dropped due to full window:  %d \n", window_full);
   printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
@@ -484,5 +2275,145 @@ int main(void)
   printf("number of packet resends by A:  %d \n", packets_resent);
   printf("number of correct packets received at B:  %d \n", packets_received);
   printf("number of messages delivered to application:  %d \n", messages_delivered);
+  if (ber > 0.0 || corruptprob > 0.0 || damaged_messages > 0)
+    printf("number of them unlike the message A sent:  %d \n", damaged_messages);
+  if (aggregate > 1 && aggregate_packets > 0)
+    printf("average number of messages per data packet:  %.2f \n",
+           (double)aggregate_messages / aggregate_packets);
+  if (pacing)
+    printf("number of new packets held back by A's pacer:  %d \n", paced_packets);
+  if (replay_wraps[A] > 0 || replay_wraps[B] > 0)
+    printf("channel recording restarted from its beginning:  %d times for A, %d for B \n",
+           replay_wraps[A], replay_wraps[B]);
+  if (fec_group > 0) {
+    printf("number of FEC parity packets sent by A:  %d \n", fec_parity_sent);
+    printf("number of packets recovered from FEC parity at B:  %d \n", fec_recovered);
+  }
+  if (gilbert || ber > 0.0 || reorder_prob > 0.0)
+    for (m = A; m <= B; m++) {
+      count_burst(m, 0);   /* close a burst still running */
+      printf("loss bursts from %c:  %d, mean length %.2f, longest %d, by length 1..%d+:",
+             "AB"[m], bursts[m].count,
+             bursts[m].count > 0 ? (double)bursts[m].lost / bursts[m].count : 0.0,
+             bursts[m].longest, BURSTHIST);
+      for (i=0; i<BURSTHIST; i++)
+        printf(" %d", bursts[m].hist[i]);
+      printf(" \n");
+      if (reorder_prob > 0.0)
+        printf("packets from %c held back for reordering:  %d \n", "AB"[m], reordered[m]);
+    }
+  if (link_bandwidth > 0.0)
+    for (m = A; m <= B; m++)
+      printf("link %s:  utilisation %.1f%%, mean queueing delay %f, %d packets dropped by the queue \n",
+             m == A ? "A->B" : "B->A", time > 0.0 ? 100.0 * links[m].busy / time : 0.0,
+             links[m].sent > 0 ? links[m].waited / links[m].sent : 0.0, links[m].drops);
+  if (consumer_slots > 0 && delivery_batches > 0)
+    printf("delivery batches to the consumer:  %d, mean %.2f and most %d messages, "
+           "mean lag %.2f and most %d messages, %d found the ring full \n",
+           delivery_batches, (double)messages_delivered / delivery_batches, delivery_batch_max,
+           consumer_lag / delivery_batches, consumer_lag_max, consumer_waits);
+  if (batch_length > 0.0) {
+    if (converged)
+      printf("stopped early: every estimate within %g of its mean\n", precision);
+    for (m=0; m<NMETRICS; m++)
+      printf("%s:  %f +/- %f (95%% confidence, %d batches of %g) \n", metric_names[m],
+             estimate_mean(&estimates[m]), estimate_halfwidth(&estimates[m]),
+             estimates[m].n, batch_length);
+  }
+#ifdef PROFILE
+  print_profile();
+#endif
+}
+
+void replicate(void)
+/* run nseeds independent copies of the simulation side by side, one */
+/* process per seed, and combine their results */
+{
+  struct estimate across[NMETRICS];
+  double value[NMETRICS];
+  pid_t *pids;
+  int *fds;
+  int fd[2];
+  int r, m;
+  size_t got;
+  ssize_t n;
+
+  pids = malloc(nseeds * sizeof(pid_t));
+  fds = malloc(nseeds * sizeof(int));
+  if (pids == NULL || fds == NULL) {
+    printf("memory allocation for replications failed.");
+    exit(EXIT_FAILURE);
+  }
+  fflush(stdout);   /* or every child prints it again */
+  for (r=0; r<nseeds; r++) {
+    if (pipe(fd) < 0 || (pids[r] = fork()) < 0) {
+      perror("replicate");
+      exit(EXIT_FAILURE);
+    }
+    if (pids[r] == 0) {   /* child: one quiet run, result to the pipe */
+      close(fd[0]);
+      if (freopen("/dev/null", "w", stdout) == NULL)
+        _exit(EXIT_FAILURE);
+      init_run(seed + r);
+      consumer_start(consumer_slots);
+      simulate();
+      consumer_stop();
+      run_metrics(value);
+      if (write(fd[1], value, sizeof(value)) != sizeof(value))
+        _exit(EXIT_FAILURE);
+      _exit(EXIT_SUCCESS);
+    }
+    close(fd[1]);
+    fds[r] = fd[0];
+  }
+
+  memset(across, 0, sizeof(across));
+  printf("\n");
+  for (r=0; r<nseeds; r++) {
+    for (got = 0; got < sizeof(value); got += n)
+      if ((n = read(fds[r], (char *)value + got, sizeof(value) - got)) <= 0)
+        break;
+    close(fds[r]);
+    waitpid(pids[r], NULL, 0);
+    if (got < sizeof(value)) {
+      printf("run with seed %u failed\n", seed + r);
+      continue;
+    }
+    printf("seed %u:", seed + r);
+    for (m=0; m<NMETRICS; m++) {
+      printf("  %s %f", metric_names[m], value[m]);
+      add_sample(&across[m], value[m]);
+    }
+    printf("\n");
+  }
+  for (m=0; m<NMETRICS; m++)
+    printf("%s:  %f +/- %f (95%% confidence, %d seeds) \n", metric_names[m],
+           estimate_mean(&across[m]), estimate_halfwidth(&across[m]), across[m].n);
+  free(pids);
+  free(fds);
+}
+
+int main(int argc, char *argv[])
+{
+  parse_args(argc, argv);
+  if (restore_name != NULL) {
+    read_snapshot(restore_name);
+    check_features();
+  }
+  else {
+    check_features();
+    init();
+    if (nseeds > 1) {
+      replicate();
+      return EXIT_SUCCESS;
+    }
+    init_run(seed);
+  }
+  consumer_start(consumer_slots);
+  simulate();
+  consumer_stop();
+  close_sampler();
+  report();
+  collect_variants();
   return EXIT_SUCCESS;
 } 
@@ -13,15 +13,34 @@ extern int packets_resent;       /* count of the number of packets resent  */
 extern int new_ACKs;      /* count of the number of acks correctly received */
 extern int packets_received;  /* count of the packets received by receiver */
 extern int window_full; /* count of the number of messages dropped due to full window */
+extern int fec_parity_sent; /* count of the FEC parity packets sent by A */
+extern int fec_recovered;   /* count of the packets B rebuilt from parity instead of waiting for a resend */
+extern int aggregate_packets;  /* count of the new data packets built by A */
+extern int aggregate_messages; /* count of the messages packed into those packets */
+extern int paced_packets;   /* count of the new packets A's pacer held back */
+
+/* protocol options, set from the emulator's command line */
+extern int congestion_control; /* non-zero enables AIMD congestion control at A */
+extern char *cwnd_logfile;     /* if set, A writes its congestion window time series here */
+extern int fec_group;          /* A sends an XOR parity packet after every fec_group data packets, 0 disables FEC */
+extern int aggregate;          /* A packs up to this many messages into one packet, 0 or 1 disables */
+extern int pacing;             /* non-zero spaces A's new packets at its estimated delivery rate */
 
 #define   A    0
 #define   B    1
 
+/* included for extension to bidirectional communication */
+#define BIDIRECTIONAL 0       /*  0 = A->B  1 =  A<->B */
+
+#define MSGSIZE 20       /* bytes in one layer 5 message */
+#define MAXAGGREGATE 4   /* most messages that may be packed into one packet */
+#define PAYLOADSIZE (MSGSIZE * MAXAGGREGATE)
+
 /* a "msg" is the data unit passed from layer 5 (teachers code) to layer  */
 /* 4 (students' code).  It contains the data (characters) to be delivered */
 /* to layer 5 via the students transport level protocol entities.         */
 struct msg {
-  char data[20];
+  char data[MSGSIZE];
 };
 
 /* a packet is the data unit passed from layer 4 (students code) to layer */
@@ -31,14 +50,34 @@ struct pkt {
   int seqnum;
   int acknum;
   int checksum;
-  char payload[20];
+  int window;        /* receiver-advertised window, carried on ACKs */
+  int length;        /* number of payload bytes in use, a multiple of MSGSIZE */
+  char payload[PAYLOADSIZE];
 };
 
 /* send to A or B (int), packet to send */
 extern void tolayer3(int, struct pkt);  
 
+/* Pooled, reference-counted packets.  A packet passed by pointer is read
+   in place and must not be changed once sent; keep it past the call by
+   taking a reference with pkt_hold. */
+extern struct pkt *pkt_alloc(void);         /* new packet, holding one reference */
+extern void pkt_hold(struct pkt *);         /* take another reference */
+extern void pkt_release(struct pkt *);      /* drop a reference */
+
+/* send to A or B (int) without copying; the caller keeps its reference */
+extern void tolayer3_ref(int, struct pkt *);
+
 /* deliver to A or B (int), data to deliver */
-extern void tolayer5(int, char[20]); 
+extern void tolayer5(int, char[MSGSIZE]); 
+
+/* deliver a run of messages, stored back to back, to A or B (int) at
+   once: A or B, data, number of messages */
+extern void tolayer5_batch(int, char *, int);
+
+/* room left in A's or B's (int) application, in messages; the receiver
+   should not advertise a window beyond it */
+extern int layer5_space(int);
 
 /* start timer at A or B (int), increment */
 extern void starttimer(int, double);       
@@ -46,3 +85,49 @@ extern void starttimer(int, double);
 /* stop timer at A or B (int) */
 extern void stoptimer(int);    
 
+/* Each entity has NTIMERS timers.  Timer 0 is the one above, whose
+   expiry calls A_timerinterrupt or B_timerinterrupt; the others, for
+   example a pacing timer, call the protocol's timer hook instead. */
+#define NTIMERS 2
+extern void starttimer_id(int, int, double);   /* A or B, timer, increment */
+extern void stoptimer_id(int, int);            /* A or B, timer */
+
+/* printf, for output under a TRACE level */
+extern void trace(char *, ...);
+
+/* current simulated time */
+extern float get_sim_time(void);
+
+/* A protocol engine.  Every hook gets the state returned by create, so
+   several engines (or several instances of one) can live in one build.
+   Packets given to A_input/B_input are read in place, see pkt_hold. */
+struct protocol {
+  char *name;
+  int features;                      /* PROTO_ flags of the options it implements */
+  void *(*create)(void);
+  void (*A_init)(void *);
+  void (*A_output)(void *, struct msg);
+  void (*A_input)(void *, struct pkt *);
+  void (*A_timerinterrupt)(void *);
+  void (*B_init)(void *);
+  void (*B_output)(void *, struct msg);
+  void (*B_input)(void *, struct pkt *);
+  void (*B_timerinterrupt)(void *);
+  void (*timer)(void *, int, int);   /* timer id (not 0) of A or B went off */
+  int (*window)(void *);             /* packets A has sent and not had acknowledged */
+  void (*save)(void *, FILE *);      /* write the state to a snapshot */
+  void (*restore)(void *, FILE *);   /* read it back, after A_init and B_init */
+};
+
+/* protocol features behind command line options; the emulator refuses
+   options the selected protocol does not implement */
+#define PROTO_CC        0x01   /* --cc and the cc variant */
+#define PROTO_CWNDLOG   0x02   /* --cwnd-log */
+#define PROTO_FEC       0x04   /* --fec */
+#define PROTO_AGGREGATE 0x08   /* --aggregate */
+#define PROTO_PACING    0x10   /* --pacing */
+
+/* raw reads and writes of snapshot contents, exiting on failure */
+extern void snapshot_put(FILE *, void *, size_t);
+extern void snapshot_get(FILE *, void *, size_t);
+
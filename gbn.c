@@ -31,83 +31,133 @@
 #define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
 #define WINDOWSIZE 6    /* the maximum number of buffered unacked packet
                           MUST BE SET TO 6 when submitting assignment */
-#define SEQSPACE 7      /* the min sequence space for GBN must be at least windowsize + 1 */
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
+#ifndef FIRSTSEQ
+#define FIRSTSEQ 0      /* A's first seqnum; build with one just short of the 32-bit wrap to test it */
+#endif
 
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your
    original checksum.  This procedure must generate a different checksum to the original if
    the packet is corrupted.
 */
-int ComputeChecksum(struct pkt packet)
+/* CRC-32 (the IEEE 802.3 polynomial, bit-reversed) over the header
+   fields and the payload in use.  Unlike a sum, flips that cancel each
+   other out still change it. */
+static unsigned long crctable[256];
+
+static unsigned long CrcBytes(unsigned long crc, unsigned long word, int n)
+{
+  unsigned long c;
+  int i, k;
+
+  if (crctable[1] == 0)
+    for (i = 0; i < 256; i++) {
+      c = i;
+      for (k = 0; k < 8; k++)
+        c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+      crctable[i] = c;
+    }
+  for (i = 0; i < n; i++, word >>= 8)
+    crc = crctable[(crc ^ word) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+static int ComputeChecksum(struct pkt *packet)
 {
-  int checksum = 0;
+  unsigned long crc = 0xffffffffUL;
   int i;
 
-  checksum = packet.seqnum;
-  checksum += packet.acknum;
-  for ( i=0; i<20; i++ )
-    checksum += (int)(packet.payload[i]);
+  crc = CrcBytes(crc, (unsigned)packet->seqnum, 4);
+  crc = CrcBytes(crc, (unsigned)packet->acknum, 4);
+  crc = CrcBytes(crc, (unsigned)packet->window, 4);
+  crc = CrcBytes(crc, (unsigned)packet->length, 4);
+  for ( i=0; i<MSGSIZE; i++ )
+    crc = CrcBytes(crc, (unsigned char)packet->payload[i], 1);
+
+  return (int)(unsigned)(crc ^ 0xffffffffUL);
+}
+
+/* serial number arithmetic (RFC 1982) on the 32-bit wrapping sequence numbers */
+static int SeqDiff(int a, int b)   /* how far a is after b, negative if before */
+{
+  return (int)((unsigned)a - (unsigned)b);
+}
 
-  return checksum;
+static int SeqAdd(int a, int n)
+{
+  return (int)((unsigned)a + (unsigned)n);
 }
 
-bool IsCorrupted(struct pkt packet)
+static bool IsCorrupted(struct pkt *packet)
 {
-  if (packet.checksum == ComputeChecksum(packet))
+  if (packet->checksum == ComputeChecksum(packet))
     return (false);
   else
     return (true);
 }
 
 
-/********* Sender (A) variables and functions ************/
+/* state of one GBN connection: sender A and receiver B */
+struct gbn_state {
+  /* sender (A) */
+  struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
+  int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
+  int windowcount;                /* the number of packets currently awaiting an ACK */
+  int A_nextseqnum;               /* the next sequence number to be used by the sender */
+
+  /* receiver (B) */
+  int expectedseqnum;             /* the sequence number expected next by the receiver */
+  int B_nextseqnum;               /* the sequence number for the next packets sent by B */
+};
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
+/********* Sender (A) variables and functions ************/
 
 /* called from layer 5 (application layer), passed the message to be sent to other side */
-void A_output(struct msg message)
+static void A_output(void *state, struct msg message)
 {
+  struct gbn_state *s = state;
   struct pkt sendpkt;
   int i;
 
   /* if not blocked waiting on ACK */
-  if ( windowcount < WINDOWSIZE) {
+  if ( s->windowcount < WINDOWSIZE) {
     if (TRACE > 1)
-      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
+      trace("----A: New message arrives, send window is not full, send new messge to layer3!\n");
 
     /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
+    sendpkt.seqnum = s->A_nextseqnum;
     sendpkt.acknum = NOTINUSE;
+    sendpkt.window = NOTINUSE;
     for ( i=0; i<20 ; i++ )
       sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt);
+    for ( ; i<PAYLOADSIZE ; i++ )
+      sendpkt.payload[i] = 0;
+    sendpkt.length = MSGSIZE;
+    sendpkt.checksum = ComputeChecksum(&sendpkt);
 
     /* put packet in window buffer */
     /* windowlast will always be 0 for alternating bit; but not for GoBackN */
-    windowlast = (windowlast + 1) % WINDOWSIZE;
-    buffer[windowlast] = sendpkt;
-    windowcount++;
+    s->windowlast = (s->windowlast + 1) % WINDOWSIZE;
+    s->buffer[s->windowlast] = sendpkt;
+    s->windowcount++;
 
     /* send out packet */
     if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
+      trace("Sending packet %d to layer 3\n", sendpkt.seqnum);
     tolayer3 (A, sendpkt);
 
     /* start timer if first packet in window */
-    if (windowcount == 1)
+    if (s->windowcount == 1)
       starttimer(A,RTT);
 
-    /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;
+    /* get next sequence number, wrapping after 2^32 - 1 */
+    s->A_nextseqnum = SeqAdd(s->A_nextseqnum, 1);
   }
   /* if blocked,  window is full */
   else {
     if (TRACE > 0)
-      printf("----A: New message arrives, send window is full\n");
+      trace("----A: New message arrives, send window is full\n");
     window_full++;
   }
 }
@@ -116,73 +166,70 @@ void A_output(struct msg message)
 /* called from layer 3, when a packet arrives for layer 4
    In this practical this will always be an ACK as B never sends data.
 */
-void A_input(struct pkt packet)
+static void A_input(void *state, struct pkt *packet)
 {
+  struct gbn_state *s = state;
   int ackcount = 0;
   int i;
 
   /* if received ACK is not corrupted */
   if (!IsCorrupted(packet)) {
     if (TRACE > 0)
-      printf("----A: uncorrupted ACK %d is received\n",packet.acknum);
+      trace("----A: uncorrupted ACK %d is received\n",packet->acknum);
     total_ACKs_received++;
 
     /* check if new ACK or duplicate */
-    if (windowcount != 0) {
-          int seqfirst = buffer[windowfirst].seqnum;
-          int seqlast = buffer[windowlast].seqnum;
-          /* check case when seqnum has and hasn't wrapped */
-          if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
-              ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) {
+    if (s->windowcount != 0) {
+          /* the ACK covers the packets up to this many after the first awaiting one */
+          int acked = SeqDiff(packet->acknum, s->buffer[s->windowfirst].seqnum);
+          if (acked >= 0 && acked < s->windowcount) {
 
             /* packet is a new ACK */
             if (TRACE > 0)
-              printf("----A: ACK %d is not a duplicate\n",packet.acknum);
+              trace("----A: ACK %d is not a duplicate\n",packet->acknum);
             new_ACKs++;
 
             /* cumulative acknowledgement - determine how many packets are ACKed */
-            if (packet.acknum >= seqfirst)
-              ackcount = packet.acknum + 1 - seqfirst;
-            else
-              ackcount = SEQSPACE - seqfirst + packet.acknum;
+            ackcount = acked + 1;
 
 	    /* slide window by the number of packets ACKed */
-            windowfirst = (windowfirst + ackcount) % WINDOWSIZE;
+            s->windowfirst = (s->windowfirst + ackcount) % WINDOWSIZE;
 
             /* delete the acked packets from window buffer */
             for (i=0; i<ackcount; i++)
-              windowcount--;
+              s->windowcount--;
 
 	    /* start timer again if there are still more unacked packets in window */
             stoptimer(A);
-            if (windowcount > 0)
+            if (s->windowcount > 0)
               starttimer(A, RTT);
 
           }
         }
         else
           if (TRACE > 0)
-        printf ("----A: duplicate ACK received, do nothing!\n");
+        trace ("----A: duplicate ACK received, do nothing!\n");
   }
   else
     if (TRACE > 0)
-      printf ("----A: corrupted ACK is received, do nothing!\n");
+      trace ("----A: corrupted ACK is received, do nothing!\n");
 }
 
 /* called when A's timer goes off */
-void A_timerinterrupt(void)
+static void A_timerinterrupt(void *state)
 {
+  struct gbn_state *s = state;
   int i;
 
   if (TRACE > 0)
-    printf("----A: time out,resend packets!\n");
+    trace("----A: time out,resend packets!\n");
 
-  for(i=0; i<windowcount; i++) {
+  for(i=0; i<s->windowcount; i++) {
 
     if (TRACE > 0)
-      printf ("---A: resending packet %d\n", (buffer[(windowfirst+i) % WINDOWSIZE]).seqnum);
+      trace ("---A: resending packet %d\n", (s->buffer[(s->windowfirst+i) % WINDOWSIZE]).seqnum);
 
-    tolayer3(A,buffer[(windowfirst+i) % WINDOWSIZE]);
+    tolayer3(A,s->buffer[(s->windowfirst+i) % WINDOWSIZE]);
     packets_resent++;
     if (i==0) starttimer(A,RTT);
   }
@@ -192,67 +239,67 @@ void A_timerinterrupt(void)
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
-void A_init(void)
+static void A_init(void *state)
 {
+  struct gbn_state *s = state;
+
   /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.
+  s->A_nextseqnum = FIRSTSEQ;  /* A starts with seq num 0, do not change this */
+  s->windowfirst = 0;
+  s->windowlast = -1;   /* windowlast is where the last packet sent is stored.
 		     new packets are placed in winlast + 1
 		     so initially this is set to -1
 		   */
-  windowcount = 0;
+  s->windowcount = 0;
 }
 
 
 
 /********* Receiver (B)  variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
-
-
 /* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(struct pkt packet)
+static void B_input(void *state, struct pkt *packet)
 {
+  struct gbn_state *s = state;
   struct pkt sendpkt;
   int i;
 
   /* if not corrupted and received packet is in order */
-  if  ( (!IsCorrupted(packet))  && (packet.seqnum == expectedseqnum) ) {
+  if  ( (!IsCorrupted(packet))  && (packet->seqnum == s->expectedseqnum) ) {
     if (TRACE > 0)
-      printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
+      trace("----B: packet %d is correctly received, send ACK!\n",packet->seqnum);
     packets_received++;
 
     /* deliver to receiving application */
-    tolayer5(B, packet.payload);
+    tolayer5_batch(B, packet->payload, 1);
 
     /* send an ACK for the received packet */
-    sendpkt.acknum = expectedseqnum;
+    sendpkt.acknum = s->expectedseqnum;
 
     /* update state variables */
-    expectedseqnum = (expectedseqnum + 1) % SEQSPACE;
+    s->expectedseqnum = SeqAdd(s->expectedseqnum, 1);
   }
   else {
     /* packet is corrupted or out of order resend last ACK */
     if (TRACE > 0)
-      printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
-    if (expectedseqnum == 0)
-      sendpkt.acknum = SEQSPACE - 1;
-    else
-      sendpkt.acknum = expectedseqnum - 1;
+      trace("----B: packet corrupted or not expected sequence number, resend ACK!\n");
+    sendpkt.acknum = SeqAdd(s->expectedseqnum, -1);
   }
 
   /* create packet */
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
+  sendpkt.seqnum = s->B_nextseqnum;
+  s->B_nextseqnum = (s->B_nextseqnum + 1) % 2;
 
   /* we don't have any data to send.  fill payload with 0's */
   for ( i=0; i<20 ; i++ )
     sendpkt.payload[i] = '0';
+  for ( ; i<PAYLOADSIZE ; i++ )
+    sendpkt.payload[i] = 0;
+  sendpkt.window = NOTINUSE;
+  sendpkt.length = MSGSIZE;
 
   /* computer checksum */
-  sendpkt.checksum = ComputeChecksum(sendpkt);
+  sendpkt.checksum = ComputeChecksum(&sendpkt);
 
   /* send out packet */
   tolayer3 (B, sendpkt);
@@ -260,10 +307,12 @@ void B_input(struct pkt packet)
 
 /* the following routine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
-void B_init(void)
+static void B_init(void *state)
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
+  struct gbn_state *s = state;
+
+  s->expectedseqnum = FIRSTSEQ;
+  s->B_nextseqnum = 1;
 }
 
 /******************************************************************************
@@ -271,11 +320,45 @@ void B_init(void)
  *****************************************************************************/
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
-void B_output(struct msg message)
+static void B_output(void *state, struct msg message)
 {
 }
 
 /* called when B's timer goes off */
-void B_timerinterrupt(void)
+static void B_timerinterrupt(void *state)
+{
+}
+
+static int Window(void *state)
+{
+  return ((struct gbn_state *)state)->windowcount;
+}
+
+/* snapshot: the state holds no pointers, so it is saved as it is */
+static void Save(void *state, FILE *f)
+{
+  snapshot_put(f, state, sizeof(struct gbn_state));
+}
+
+static void Restore(void *state, FILE *f)
+{
+  snapshot_get(f, state, sizeof(struct gbn_state));
+}
+
+static void *Create(void)
 {
+  struct gbn_state *s = malloc(sizeof(struct gbn_state));
+
+  if (s == NULL) {
+    printf("memory allocation for GBN state failed.");
+    exit(EXIT_FAILURE);
+  }
+  return s;
 }
+
+struct protocol gbn_protocol = {
+  "gbn", 0, Create,
+  A_init, A_output, A_input, A_timerinterrupt,
+  B_init, B_output, B_input, B_timerinterrupt,
+  NULL, Window, Save, Restore
+};
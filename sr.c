@@ -6,9 +6,10 @@
 //===================================*/
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include "emulator.h"
-#include "gbn.h"
+#include "sr.h"
 
 /* ******************************************************************
    Go Back N protocol.  Adapted from J.F.Kurose
@@ -31,186 +32,698 @@
 #define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
 #define WINDOWSIZE 6    /* the maximum number of buffered unacked packet
                           MUST BE SET TO 6 when submitting assignment */
-#define SEQSPACE 7      /* the min sequence space for GBN must be at least windowsize + 1 */
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
+#ifndef FIRSTSEQ
+#define FIRSTSEQ 0      /* A's first seqnum; build with one just short of the 32-bit wrap to test it */
+#endif
+#define DUPACKTHRESH 3  /* duplicate ACKs that signal a loss to congestion control */
+#define FECPARITY (-2)  /* acknum marking an FEC parity packet; its seqnum is the group's first */
+#define PACETIMER 1     /* A's timer id for releasing the next paced packet */
+#define PACEGAIN 1.25   /* pace a little above the measured rate so A can find more */
+#define RATEGAIN 0.125  /* weight of a new sample in the delivery rate average */
+
+/* CRC-32 (the IEEE 802.3 polynomial, bit-reversed) over the header
+   fields and the payload in use.  Unlike a sum, flips that cancel each
+   other out still change it. */
+static unsigned long crctable[256];
+
+static unsigned long CrcBytes(unsigned long crc, unsigned long word, int n)
+{
+  unsigned long c;
+  int i, k;
+
+  if (crctable[1] == 0)
+    for (i = 0; i < 256; i++) {
+      c = i;
+      for (k = 0; k < 8; k++)
+        c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+      crctable[i] = c;
+    }
+  for (i = 0; i < n; i++, word >>= 8)
+    crc = crctable[(crc ^ word) & 0xff] ^ (crc >> 8);
+  return crc;
+}
 
-int ComputeChecksum(struct pkt packet)
+static int ComputeChecksum(struct pkt *packet)
 {
-  int checksum = 0;
+  unsigned long crc = 0xffffffffUL;
   int i;
 
-  checksum = packet.seqnum;
-  checksum += packet.acknum;
-  for ( i=0; i<20; i++ )
-    checksum += (int)(packet.payload[i]);
+  crc = CrcBytes(crc, (unsigned)packet->seqnum, 4);
+  crc = CrcBytes(crc, (unsigned)packet->acknum, 4);
+  crc = CrcBytes(crc, (unsigned)packet->window, 4);
+  crc = CrcBytes(crc, (unsigned)packet->length, 4);
+  for ( i=0; i<packet->length && i<PAYLOADSIZE; i++ )
+    crc = CrcBytes(crc, (unsigned char)packet->payload[i], 1);
+
+  return (int)(unsigned)(crc ^ 0xffffffffUL);
+}
 
-  return checksum;
+/* Sequence numbers use all 32 bits and wrap.  As in RFC 1982 they are
+   compared by their distance, which is right while the two are less
+   than 2^31 apart; windows are far smaller than that. */
+static int SeqDiff(int a, int b)   /* how far a is after b, negative if before */
+{
+  return (int)((unsigned)a - (unsigned)b);
+}
+
+static int SeqAdd(int a, int n)
+{
+  return (int)((unsigned)a + (unsigned)n);
 }
 
-bool IsCorrupted(struct pkt packet)
+static bool IsCorrupted(struct pkt *packet)
 {
-  if (packet.checksum == ComputeChecksum(packet))
+  if (packet->checksum == ComputeChecksum(packet))
     return (false);
   else
     return (true);
 }
 
+/* state of one SR connection: sender A and receiver B */
+struct sr_state {
+  /* sender (A) */
+  struct pkt *buffer[WINDOWSIZE]; /* array for storing packets waiting for ACK */
+  int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
+  int windowcount;                /* the number of packets currently awaiting an ACK */
+  int A_nextseqnum;               /* the next sequence number to be used by the sender */
+  double cwnd;                    /* congestion window in packets, grown and cut by AIMD */
+  double ssthresh;                /* cwnd below which A is in slow start */
+  int rwnd;                       /* window last advertised by B */
+  int dupacks;                    /* duplicate ACKs received since the last new ACK */
+  FILE *cwndlog;                  /* cwnd time series output, NULL if not wanted */
+  struct pkt *fecpkt;             /* parity of the FEC group being sent */
+  int fecsent;                    /* data packets already folded into fecpkt */
+  struct pkt *pending;            /* messages waiting to be sent as one aggregate packet */
+  int unsent;                     /* packets at the end of the window held back by the pacer */
+  double pacerate;                /* average ACKed packets per time unit, 0 until measured */
+  double lastack;                 /* time of the last new ACK, -1 after the window drained */
+  double nextsend;                /* earliest time the pacer releases the next packet */
+  bool pacetimer;                 /* PACETIMER is running */
+
+  /* receiver (B) */
+  int expectedseqnum;             /* the sequence number expected next by the receiver */
+  int B_nextseqnum;               /* the sequence number for the next packets sent by B */
+  int rcvfirst;                   /* rcvbuffer slot of expectedseqnum */
+  struct pkt *rcvbuffer[WINDOWSIZE]; /* out-of-order packets, see Slot */
+  bool received[WINDOWSIZE];      /* which rcvbuffer slots hold an undelivered packet */
+};
+
 /********* Sender (A) variables and functions ************/
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
+/* number of packets A may currently have awaiting an ACK */
+static int SendWindow(struct sr_state *s)
+{
+  int limit = WINDOWSIZE;
+
+  if (congestion_control && (int)s->cwnd < limit)
+    limit = (int)s->cwnd;
+  if (s->rwnd < limit)
+    limit = s->rwnd;
+  /* never shut the window completely while nothing is outstanding,
+     otherwise no ACK would ever arrive to open it again */
+  if (limit < 1 && s->windowcount == 0)
+    limit = 1;
+  return limit;
+}
+
+static void LogWindow(struct sr_state *s)
+{
+  if (s->cwndlog != NULL)
+    fprintf(s->cwndlog, "%f %f %f %d %d\n", get_sim_time(), s->cwnd, s->ssthresh, s->windowcount, s->rwnd);
+}
 
-void A_output(struct msg message)
+/* fold a newly sent packet into the current FEC group, and send the
+   group's parity once it holds fec_group packets.  The parity's window
+   field carries the XOR of the members' lengths. */
+static void FecAdd(struct sr_state *s, struct pkt *packet)
 {
-  struct pkt sendpkt;
   int i;
 
-  if ( windowcount < WINDOWSIZE) {
+  if (s->fecsent == 0) {
+    s->fecpkt = pkt_alloc();
+    s->fecpkt->seqnum = packet->seqnum;
+    s->fecpkt->window = 0;
+    s->fecpkt->length = PAYLOADSIZE;
+    for (i=0; i<PAYLOADSIZE; i++)
+      s->fecpkt->payload[i] = 0;
+  }
+  s->fecpkt->window ^= packet->length;
+  for (i=0; i<PAYLOADSIZE; i++)
+    s->fecpkt->payload[i] ^= packet->payload[i];
+
+  if (++s->fecsent == fec_group) {
+    s->fecpkt->acknum = FECPARITY;
+    s->fecpkt->checksum = ComputeChecksum(s->fecpkt);
     if (TRACE > 0)
-      printf("----A: New message arrives, send window is not full, send new message to layer3!\n");
+      trace("Sending FEC parity for packets %d..%d to layer 3\n", s->fecpkt->seqnum,
+             SeqAdd(s->fecpkt->seqnum, fec_group - 1));
+    tolayer3_ref(A, s->fecpkt);
+    pkt_release(s->fecpkt);
+    fec_parity_sent++;
+    s->fecsent = 0;
+  }
+}
 
-    sendpkt.seqnum = A_nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for ( i=0; i<20 ; i++ )
-      sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt);
+/* multiplicative decrease of the congestion window after a loss */
+static void CwndLoss(struct sr_state *s, bool timeout)
+{
+  s->ssthresh = s->cwnd / 2;
+  if (s->ssthresh < 1)
+    s->ssthresh = 1;
+  s->cwnd = timeout ? 1 : s->ssthresh;
+  if (TRACE > 0)
+    trace("----A: loss detected, cwnd is now %.2f\n", s->cwnd);
+}
 
-    windowlast = (windowlast + 1) % WINDOWSIZE;
-    buffer[windowlast] = sendpkt;
-    windowcount++;
+/* send a packet of the window for the first time */
+static void Transmit(struct sr_state *s, struct pkt *sendpkt)
+{
+  if (TRACE > 0)
+    trace("Sending packet %d to layer 3\n", sendpkt->seqnum);
+  tolayer3_ref(A, sendpkt);
+  if (fec_group > 0)
+    FecAdd(s, sendpkt);
 
-    if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3 (A, sendpkt);
+  if (s->windowcount - s->unsent == 0)
+    starttimer(A,RTT);
+}
+
+/* Send the packets the pacer holds back, one every 1/(PACEGAIN*pacerate)
+   time units, rather than as a burst the bottleneck queue has to absorb.
+   Until the first rate sample, and without --pacing, they all go at once. */
+static void Pace(struct sr_state *s)
+{
+  double now = get_sim_time();
+
+  while (s->unsent > 0 && !s->pacetimer) {
+    if (pacing && s->pacerate > 0 && s->nextsend > now) {
+      starttimer_id(A, PACETIMER, s->nextsend - now);
+      s->pacetimer = true;
+      return;
+    }
+    Transmit(s, s->buffer[(s->windowlast - s->unsent + 1 + WINDOWSIZE) % WINDOWSIZE]);
+    s->unsent--;
+    if (pacing && s->pacerate > 0) {
+      if (s->nextsend < now)
+        s->nextsend = now;
+      s->nextsend += 1 / (PACEGAIN * s->pacerate);
+    }
+  }
+}
+
+/* fold the ACK of count packets into the delivery rate average */
+static void UpdateRate(struct sr_state *s, int count)
+{
+  double now = get_sim_time();
+  double sample;
+
+  if (s->lastack >= 0 && now > s->lastack) {
+    sample = count / (now - s->lastack);
+    if (s->pacerate == 0)
+      s->pacerate = sample;
+    else
+      s->pacerate += RATEGAIN * (sample - s->pacerate);
+  }
+  s->lastack = now;
+}
 
-    if (windowcount == 1)
-      starttimer(A,RTT);
+/* number, checksum and queue a new data packet for the pacer; the
+   window takes over the caller's reference to it */
+static void SendNew(struct sr_state *s, struct pkt *sendpkt)
+{
+  int i;
+
+  sendpkt->seqnum = s->A_nextseqnum;
+  sendpkt->acknum = NOTINUSE;
+  sendpkt->window = NOTINUSE;
+  for ( i=sendpkt->length; i<PAYLOADSIZE; i++ )
+    sendpkt->payload[i] = 0;
+  sendpkt->checksum = ComputeChecksum(sendpkt);
+  aggregate_packets++;
+  aggregate_messages += sendpkt->length / MSGSIZE;
+
+  s->windowlast = (s->windowlast + 1) % WINDOWSIZE;
+  s->buffer[s->windowlast] = sendpkt;
+  s->windowcount++;
+  s->unsent++;
+  s->A_nextseqnum = SeqAdd(s->A_nextseqnum, 1);
+
+  Pace(s);
+  if (s->unsent > 0)
+    paced_packets++;
+  LogWindow(s);
+}
+
+/* Send the pending aggregate if the window allows it.  Like Nagle's
+   algorithm, a partly filled aggregate is only sent while nothing is
+   awaiting an ACK, so the next ACK is the hold timer. */
+static void FlushPending(struct sr_state *s)
+{
+  if (s->pending == NULL || s->windowcount >= SendWindow(s))
+    return;
+  if (s->pending->length < aggregate * MSGSIZE && s->windowcount > 0)
+    return;
+  SendNew(s, s->pending);
+  s->pending = NULL;
+}
+
+static void A_output(void *state, struct msg message)
+{
+  struct sr_state *s = state;
+  struct pkt *sendpkt;
+  int i;
+
+  if (aggregate > 1) {
+    if (s->pending == NULL || s->pending->length < aggregate * MSGSIZE) {
+      if (TRACE > 0)
+        trace("----A: New message arrives, add it to the pending packet\n");
+      if (s->pending == NULL) {
+        s->pending = pkt_alloc();
+        s->pending->length = 0;
+      }
+      for ( i=0; i<MSGSIZE ; i++ )
+        s->pending->payload[s->pending->length + i] = message.data[i];
+      s->pending->length += MSGSIZE;
+      FlushPending(s);
+    }
+    else {
+      if (TRACE > 0)
+        trace("----A: New message arrives, send window and pending packet are full\n");
+      window_full++;
+    }
+  }
+  else if ( s->windowcount < SendWindow(s)) {
+    if (TRACE > 0)
+      trace("----A: New message arrives, send window is not full, send new message to layer3!\n");
 
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;
+    sendpkt = pkt_alloc();
+    for ( i=0; i<MSGSIZE ; i++ )
+      sendpkt->payload[i] = message.data[i];
+    sendpkt->length = MSGSIZE;
+    SendNew(s, sendpkt);
   }
   else {
     if (TRACE > 0)
-      printf("----A: New message arrives, send window is full\n");
+      trace("----A: New message arrives, send window is full\n");
     window_full++;
   }
 }
 
-void A_input(struct pkt packet)
+static void A_input(void *state, struct pkt *packet)
 {
+  struct sr_state *s = state;
   int ackcount = 0;
   int i;
 
   if (!IsCorrupted(packet)) {
     if (TRACE > 0)
-      printf("----A: uncorrupted ACK %d is received\n",packet.acknum);
+      trace("----A: uncorrupted ACK %d is received\n",packet->acknum);
     total_ACKs_received++;
+    s->rwnd = packet->window;
 
-    if (windowcount != 0) {
-      int seqfirst = buffer[windowfirst].seqnum;
-      int seqlast = buffer[windowlast].seqnum;
+    /* only packets the pacer has released can be acknowledged */
+    if (s->windowcount > s->unsent) {
+      /* the ACK covers the packets up to this many after the first awaiting one */
+      int acked = SeqDiff(packet->acknum, s->buffer[s->windowfirst]->seqnum);
 
-      if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
-          ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) {
+      if (acked >= 0 && acked < s->windowcount - s->unsent) {
 
         if (TRACE > 0)
-          printf("----A: ACK %d is not a duplicate\n",packet.acknum);
+          trace("----A: ACK %d is not a duplicate\n",packet->acknum);
         new_ACKs++;
 
-        if (packet.acknum >= seqfirst)
-          ackcount = packet.acknum + 1 - seqfirst;
-        else
-          ackcount = SEQSPACE - seqfirst + packet.acknum;
-
-        windowfirst = (windowfirst + ackcount) % WINDOWSIZE;
-
-        for (i=0; i<ackcount; i++)
-          windowcount--;
+        ackcount = acked + 1;
+        if (pacing)
+          UpdateRate(s, ackcount);
+
+        for (i=0; i<ackcount; i++) {
+          pkt_release(s->buffer[s->windowfirst]);
+          s->buffer[s->windowfirst] = NULL;
+          s->windowfirst = (s->windowfirst + 1) % WINDOWSIZE;
+          s->windowcount--;
+          /* additive increase: one packet per ACK in slow start, one per window after */
+          if (s->cwnd < s->ssthresh)
+            s->cwnd += 1;
+          else
+            s->cwnd += 1 / s->cwnd;
+        }
+        if (s->cwnd > WINDOWSIZE)
+          s->cwnd = WINDOWSIZE;
+        s->dupacks = 0;
+        /* the next ACK after an idle spell says nothing about the rate */
+        if (s->windowcount == 0)
+          s->lastack = -1;
 
         stoptimer(A);
-        if (windowcount > 0)
+        if (s->windowcount > s->unsent)
           starttimer(A, RTT);
+        if (aggregate > 1)
+          FlushPending(s);
+      }
+      else {
+        if (TRACE > 0)
+          trace("----A: duplicate ACK received, do nothing!\n");
+        /* fast retransmit of the earliest unacknowledged packet */
+        if (congestion_control && ++s->dupacks == DUPACKTHRESH) {
+          CwndLoss(s, false);
+          tolayer3_ref(A, s->buffer[s->windowfirst]);
+          packets_resent++;
+        }
       }
     }
     else if (TRACE > 0)
-      printf("----A: duplicate ACK received, do nothing!\n");
+      trace("----A: duplicate ACK received, do nothing!\n");
+    LogWindow(s);
   }
   else if (TRACE > 0)
-    printf("----A: corrupted ACK is received, do nothing!\n");
+    trace("----A: corrupted ACK is received, do nothing!\n");
 }
 
-void A_timerinterrupt(void)
+static void A_timerinterrupt(void *state)
 {
+  struct sr_state *s = state;
+
   if (TRACE > 0)
-    printf("----A: time out,resend packets!\n");
+    trace("----A: time out,resend packets!\n");
 
 /* Resend only the earliest unacknowledged packet*/
-  if (windowcount > 0) {
+  if (s->windowcount > s->unsent) {
     if (TRACE > 0)
-      printf("---A: resending packet %d\n", buffer[windowfirst].seqnum);
+      trace("---A: resending packet %d\n", s->buffer[s->windowfirst]->seqnum);
 
-    tolayer3(A, buffer[windowfirst]);
+    tolayer3_ref(A, s->buffer[s->windowfirst]);
     packets_resent++;
     starttimer(A, RTT);
+    if (congestion_control)
+      CwndLoss(s, true);
+    s->dupacks = 0;
+    LogWindow(s);
   }
 }
 
-void A_init(void)
+static void A_init(void *state)
 {
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.
+  struct sr_state *s = state;
+
+  s->A_nextseqnum = FIRSTSEQ;  /* A starts with seq num 0, do not change this */
+  s->windowfirst = 0;
+  s->windowlast = -1;   /* windowlast is where the last packet sent is stored.
                        new packets are placed in winlast + 1 */
-  windowcount = 0;
+  s->windowcount = 0;
+  s->cwnd = 1;
+  s->ssthresh = WINDOWSIZE;
+  s->rwnd = WINDOWSIZE;
+  s->dupacks = 0;
+  s->fecsent = 0;
+  s->pending = NULL;
+  s->unsent = 0;
+  s->pacerate = 0;
+  s->lastack = -1;
+  s->nextsend = 0;
+  s->pacetimer = false;
+  if (fec_group < 0 || fec_group > WINDOWSIZE) {
+    printf("FEC group size must be between 0 and %d\n", WINDOWSIZE);
+    exit(EXIT_FAILURE);
+  }
+  if (aggregate < 0 || aggregate > MAXAGGREGATE) {
+    printf("aggregation must be between 0 and %d messages\n", MAXAGGREGATE);
+    exit(EXIT_FAILURE);
+  }
+  s->cwndlog = NULL;
+  if (cwnd_logfile != NULL) {
+    s->cwndlog = fopen(cwnd_logfile, "w");
+    if (s->cwndlog == NULL) {
+      printf("unable to open cwnd log %s\n", cwnd_logfile);
+      exit(EXIT_FAILURE);
+    }
+    fprintf(s->cwndlog, "# time cwnd ssthresh inflight rwnd\n");
+  }
 }
 
 /********* Receiver (B)  variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+/* rcvbuffer slot of seq.  The slots follow the sequence numbers round
+   from rcvfirst, so each one keeps its slot as expectedseqnum moves on
+   and across the 32-bit wrap. */
+static int Slot(struct sr_state *s, int seq)
+{
+  return (s->rcvfirst + SeqDiff(seq, s->expectedseqnum) % WINDOWSIZE + WINDOWSIZE) % WINDOWSIZE;
+}
 
-void B_input(struct pkt packet)
+/* is seq one of the WINDOWSIZE numbers B accepts next? */
+static bool InWindow(struct sr_state *s, int seq)
 {
-  struct pkt sendpkt;
-  int i;
+  return (unsigned)SeqDiff(seq, s->expectedseqnum) < WINDOWSIZE;
+}
 
-  if  ( (!IsCorrupted(packet))  && (packet.seqnum == expectedseqnum) ) {
-    if (TRACE > 0)
-      printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
-    packets_received++;
+/* packets B can take past expectedseqnum: a whole window, unless the
+   application's ring has room for fewer, counting each packet as full */
+static int Room(void)
+{
+  int space = layer5_space(B) / (aggregate > 1 ? aggregate : 1);
+
+  return space < WINDOWSIZE ? space : WINDOWSIZE;
+}
 
-    tolayer5(B, packet.payload);
+/* will B take seq now?  Like InWindow, but within Room, so whatever
+   B holds fits the ring once delivered and delivery never waits on it */
+static bool Accepts(struct sr_state *s, int seq)
+{
+  return (unsigned)SeqDiff(seq, s->expectedseqnum) < (unsigned)Room();
+}
+
+/* hold a reference to packet in its rcvbuffer slot, dropping the slot's old packet */
+static void StorePacket(struct sr_state *s, struct pkt *packet)
+{
+  int slot = Slot(s, packet->seqnum);
 
-    sendpkt.acknum = expectedseqnum;
-    expectedseqnum = (expectedseqnum + 1) % SEQSPACE;
+  if (s->rcvbuffer[slot] != NULL)
+    pkt_release(s->rcvbuffer[slot]);
+  s->rcvbuffer[slot] = packet;
+  s->received[slot] = true;
+}
+
+/* Try to rebuild a single missing packet of an FEC group from its parity.
+   Members behind expectedseqnum have been delivered but stay in rcvbuffer
+   until the slot is reused, which the seqnum check detects.
+   Returns true if a packet was recovered into rcvbuffer. */
+static bool FecRecover(struct sr_state *s, struct pkt *parity)
+{
+  struct pkt *rebuilt;
+  int missing = -1, nmissing = 0;
+  int i, j, seq, slot;
+
+  for (i=0; i<fec_group; i++) {
+    seq = SeqAdd(parity->seqnum, i);
+    slot = Slot(s, seq);
+    if (!(InWindow(s, seq) ? s->received[slot]
+          : s->rcvbuffer[slot] != NULL && s->rcvbuffer[slot]->seqnum == seq)) {
+      missing = seq;
+      nmissing++;
+    }
   }
-  else {
-    if (TRACE > 0)
-      printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
-    if (expectedseqnum == 0)
-      sendpkt.acknum = SEQSPACE - 1;
-    else
-      sendpkt.acknum = expectedseqnum - 1;
+  if (nmissing != 1 || !Accepts(s, missing))
+    return false;
+
+  rebuilt = pkt_alloc();
+  rebuilt->length = parity->window;
+  for (j=0; j<PAYLOADSIZE; j++)
+    rebuilt->payload[j] = parity->payload[j];
+  for (i=0; i<fec_group; i++) {
+    seq = SeqAdd(parity->seqnum, i);
+    if (seq == missing)
+      continue;
+    slot = Slot(s, seq);
+    rebuilt->length ^= s->rcvbuffer[slot]->length;
+    for (j=0; j<PAYLOADSIZE; j++)
+      rebuilt->payload[j] ^= s->rcvbuffer[slot]->payload[j];
+  }
+
+  if (TRACE > 0)
+    trace("----B: packet %d recovered from FEC parity\n", missing);
+  rebuilt->seqnum = missing;
+  rebuilt->acknum = NOTINUSE;
+  rebuilt->window = NOTINUSE;
+  rebuilt->checksum = ComputeChecksum(rebuilt);
+  StorePacket(s, rebuilt);
+  fec_recovered++;
+  return true;
+}
+
+/* deliver the run of in-order packets now at the head of rcvbuffer
+   as one batch, splitting aggregate packets back into their messages */
+static void DeliverInOrder(struct sr_state *s)
+{
+  char batch[WINDOWSIZE * PAYLOADSIZE];
+  int slot, length = 0;
+
+  while (s->received[s->rcvfirst]) {
+    slot = s->rcvfirst;
+    memcpy(batch + length, s->rcvbuffer[slot]->payload, s->rcvbuffer[slot]->length);
+    length += s->rcvbuffer[slot]->length;
+    s->received[slot] = false;
+    s->expectedseqnum = SeqAdd(s->expectedseqnum, 1);
+    s->rcvfirst = (s->rcvfirst + 1) % WINDOWSIZE;
   }
+  if (length > 0)
+    tolayer5_batch(B, batch, length / MSGSIZE);
+}
+
+/* cumulative ACK for the last packet delivered in order */
+static void SendAck(struct sr_state *s)
+{
+  struct pkt *sendpkt;
+
+  sendpkt = pkt_alloc();
+  sendpkt->acknum = SeqAdd(s->expectedseqnum, -1);
+  /* A counts its window from the cumulative ACK, packets B holds past a
+     hole included, so B advertises just what it will take from there */
+  sendpkt->window = Room();
 
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
+  sendpkt->seqnum = s->B_nextseqnum;
+  s->B_nextseqnum = (s->B_nextseqnum + 1) % 2;
 
-  for ( i=0; i<20 ; i++ )
-    sendpkt.payload[i] = '0';
+  /* we don't have any data to send */
+  sendpkt->length = 0;
 
-  sendpkt.checksum = ComputeChecksum(sendpkt);
+  sendpkt->checksum = ComputeChecksum(sendpkt);
 
-  tolayer3 (B, sendpkt);
+  tolayer3_ref(B, sendpkt);
+  pkt_release(sendpkt);
 }
 
-void B_init(void)
+static void B_input(void *state, struct pkt *packet)
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
+  struct sr_state *s = state;
+  int slot;
+
+  /* parity is never acknowledged itself, only the packet it recovers */
+  if (packet->acknum == FECPARITY) {
+    if (!IsCorrupted(packet) && FecRecover(s, packet)) {
+      DeliverInOrder(s);
+      SendAck(s);
+    }
+    return;
+  }
+
+  if ( (!IsCorrupted(packet)) && Accepts(s, packet->seqnum) ) {
+    slot = Slot(s, packet->seqnum);
+    if (!s->received[slot]) {
+      if (TRACE > 0)
+        trace("----B: packet %d is correctly received, send ACK!\n",packet->seqnum);
+      packets_received++;
+      pkt_hold(packet);
+      StorePacket(s, packet);
+    }
+    DeliverInOrder(s);
+  }
+  else if (TRACE > 0)
+    trace("----B: packet corrupted or not expected sequence number, resend ACK!\n");
+
+  SendAck(s);
 }
 
-void B_output(struct msg message) {}
+static void B_init(void *state)
+{
+  struct sr_state *s = state;
+  int i;
+
+  s->expectedseqnum = FIRSTSEQ;
+  s->rcvfirst = 0;
+  s->B_nextseqnum = 1;
+  for (i=0; i<WINDOWSIZE; i++) {
+    s->rcvbuffer[i] = NULL;
+    s->received[i] = false;
+  }
+}
+
+static void B_output(void *state, struct msg message) {}
+
+static void B_timerinterrupt(void *state) {}
+
+/* only A runs a second timer, PACETIMER */
+static void Timer(void *state, int AorB, int id)
+{
+  struct sr_state *s = state;
+
+  /* the next packet is due, even if the float clock stopped short of nextsend */
+  s->pacetimer = false;
+  s->nextsend = get_sim_time();
+  Pace(s);
+  LogWindow(s);
+}
+
+/* packets sent and awaiting an ACK, not those still held by the pacer */
+static int Window(void *state)
+{
+  struct sr_state *s = state;
+
+  return s->windowcount - s->unsent;
+}
+
+/* snapshot: the state struct, then each packet it points to */
+static void Save(void *state, FILE *f)
+{
+  struct sr_state *s = state;
+  int i;
+
+  snapshot_put(f, s, sizeof(*s));
+  for (i=0; i<s->windowcount; i++)
+    snapshot_put(f, s->buffer[(s->windowfirst + i) % WINDOWSIZE], sizeof(struct pkt));
+  if (s->fecsent > 0)
+    snapshot_put(f, s->fecpkt, sizeof(struct pkt));
+  if (s->pending != NULL)
+    snapshot_put(f, s->pending, sizeof(struct pkt));
+  for (i=0; i<WINDOWSIZE; i++)
+    if (s->rcvbuffer[i] != NULL)
+      snapshot_put(f, s->rcvbuffer[i], sizeof(struct pkt));
+}
+
+static struct pkt *LoadPacket(FILE *f)
+{
+  struct pkt *packet = pkt_alloc();
+
+  snapshot_get(f, packet, sizeof(struct pkt));
+  return packet;
+}
+
+/* the saved pointers only say which packets follow; cwndlog stays as A_init opened it */
+static void Restore(void *state, FILE *f)
+{
+  struct sr_state *s = state;
+  FILE *cwndlog = s->cwndlog;
+  int i;
+
+  snapshot_get(f, s, sizeof(*s));
+  s->cwndlog = cwndlog;
+  for (i=0; i<WINDOWSIZE; i++)
+    s->buffer[i] = NULL;
+  for (i=0; i<s->windowcount; i++)
+    s->buffer[(s->windowfirst + i) % WINDOWSIZE] = LoadPacket(f);
+  if (s->fecsent > 0)
+    s->fecpkt = LoadPacket(f);
+  if (s->pending != NULL)
+    s->pending = LoadPacket(f);
+  for (i=0; i<WINDOWSIZE; i++)
+    if (s->rcvbuffer[i] != NULL)
+      s->rcvbuffer[i] = LoadPacket(f);
+}
+
+static void *Create(void)
+{
+  struct sr_state *s = malloc(sizeof(struct sr_state));
+
+  if (s == NULL) {
+    printf("memory allocation for SR state failed.");
+    exit(EXIT_FAILURE);
+  }
+  return s;
+}
 
-void B_timerinterrupt(void) {}
+struct protocol sr_protocol = {
+  "sr", PROTO_CC | PROTO_CWNDLOG | PROTO_FEC | PROTO_AGGREGATE | PROTO_PACING, Create,
+  A_init, A_output, A_input, A_timerinterrupt,
+  B_init, B_output, B_input, B_timerinterrupt,
+  Timer, Window, Save, Restore
+};